@@ -0,0 +1,378 @@
+/*
+  Copyright (C) 2026 Pawel A. Gajda <mis@pld-linux.org>
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Library General Public License, version 2
+  as published by the Free Software Foundation (see file COPYING for details).
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+#include <openssl/evp.h>
+
+#include <trurl/nassert.h>
+#include <trurl/n_snprintf.h>
+
+#include "compiler.h"
+#include "tndb_int.h"
+#include "tndb.h"
+
+/*
+  Private cache of inflated copies of compressed databases
+  (TNDB_O_INFLATE_CACHE). Copy of db is named as
+  sha1(db's absolute path).size.mtime, so it is invalidated by any change
+  of the original file.
+*/
+
+static char cachedir[PATH_MAX];
+
+int tndb_set_cachedir(const char *dir)
+{
+    if (dir == NULL) {
+        *cachedir = '\0';
+        return 1;
+    }
+
+    if (strlen(dir) >= sizeof(cachedir)) {
+        errno = ENAMETOOLONG;
+        return 0;
+    }
+
+    n_snprintf(cachedir, sizeof(cachedir), "%s", dir);
+    return 1;
+}
+
+static int mkdir_p(char *path, mode_t mode)
+{
+    char *p = path;
+
+    while ((p = strchr(p + 1, '/')) != NULL) {
+        *p = '\0';
+        if (mkdir(path, mode) != 0 && errno != EEXIST) {
+            *p = '/';
+            return 0;
+        }
+        *p = '/';
+    }
+
+    return mkdir(path, mode) == 0 || errno == EEXIST;
+}
+
+/* returns path of cache directory, which may not exist */
+static const char *cachedir_path(char *buf, int size)
+{
+    const char *dir;
+
+    if (*cachedir)
+        n_snprintf(buf, size, "%s", cachedir);
+
+    else if ((dir = getenv("XDG_CACHE_HOME")) && *dir)
+        n_snprintf(buf, size, "%s/tndb", dir);
+
+    else if ((dir = getenv("HOME")) && *dir)
+        n_snprintf(buf, size, "%s/.cache/tndb", dir);
+
+    else
+        return NULL;
+
+    return buf;
+}
+
+/* returns cache directory, created if needed */
+const char *tndb_cachedir(char *buf, int size)
+{
+    if (cachedir_path(buf, size) == NULL)
+        return NULL;
+
+    if (!mkdir_p(buf, 0700)) {
+        DBGF("%s: mkdir failed: %m\n", buf);
+        return NULL;
+    }
+
+    return buf;
+}
+
+/* hex sha1 of db's absolute path */
+static int cache_key(const char *path, char *key, int size)
+{
+    char          rpath[PATH_MAX];
+    unsigned char md[EVP_MAX_MD_SIZE];
+    unsigned      md_size = 0;
+
+    if (realpath(path, rpath) == NULL)
+        return 0;
+
+    if (!EVP_Digest(rpath, strlen(rpath), md, &md_size, EVP_sha1(), NULL))
+        return 0;
+
+    return tndb_bin2hex(key, size, md, md_size) > 0;
+}
+
+/* n_snprintf() returns either truncated or needed length */
+#define PATH_TRUNCATED(n, size) ((n) < 0 || (n) >= (int)(size) - 1)
+
+/* removes copies of previous versions of db */
+static void cache_purge(const char *dir, const char *key)
+{
+    struct dirent *ent;
+    DIR           *d;
+    int           n, len = strlen(key);
+
+    if ((d = opendir(dir)) == NULL)
+        return;
+
+    while ((ent = readdir(d)) != NULL) {
+        char path[PATH_MAX];
+
+        if (strncmp(ent->d_name, key, len) != 0 || ent->d_name[len] != '.')
+            continue;
+
+        if (strstr(ent->d_name, ".tmp") != NULL) /* being written */
+            continue;
+
+        n = n_snprintf(path, sizeof(path), "%s/%s", dir, ent->d_name);
+        if (PATH_TRUNCATED(n, sizeof(path)))
+            continue;
+
+        DBGF("unlink %s\n", path);
+        unlink(path);
+    }
+
+    closedir(d);
+}
+
+static int inflate_to(tn_stream *st, int fd)
+{
+    char buf[1024 * 16];
+    int  n;
+
+    if (n_stream_seek(st, 0, SEEK_SET) == -1)
+        return 0;
+
+    while ((n = n_stream_read(st, buf, sizeof(buf))) > 0) {
+        if (write(fd, buf, n) != n)
+            return 0;
+    }
+
+    return n == 0;
+}
+
+/*
+  Returns stream of inflated copy of compressed db read by st, the copy
+  is created if it does not exist yet. Returns NULL if cache is not usable,
+  caller reads st as usual then.
+*/
+tn_stream *tndb_cache_inflated(tn_stream *st, int fd, const char *path)
+{
+    char        dir[PATH_MAX], key[64], cpath[PATH_MAX], tmpath[PATH_MAX];
+    struct stat stbuf;
+    tn_stream   *cst;
+    int         n, tfd, ok;
+
+    if ((fd >= 0 ? fstat(fd, &stbuf) : stat(path, &stbuf)) != 0)
+        return NULL;
+
+    if (tndb_cachedir(dir, sizeof(dir)) == NULL)
+        return NULL;
+
+    if (!cache_key(path, key, sizeof(key)))
+        return NULL;
+
+    /* truncated name would lose size and mtime which invalidate copy */
+    n = n_snprintf(cpath, sizeof(cpath), "%s/%s.%lld.%lld", dir, key,
+                   (long long)stbuf.st_size, (long long)stbuf.st_mtime);
+    if (PATH_TRUNCATED(n, sizeof(cpath)))
+        return NULL;
+
+    if ((cst = n_stream_open(cpath, "rb", TN_STREAM_STDIO)) != NULL) {
+        DBGF("%s: cached as %s\n", path, cpath);
+        return cst;
+    }
+
+    n = n_snprintf(tmpath, sizeof(tmpath), "%s.tmpXXXXXX", cpath);
+    if (PATH_TRUNCATED(n, sizeof(tmpath)))
+        return NULL;
+
+#ifdef HAVE_MKSTEMP
+    tfd = mkstemp(tmpath);
+#else
+    tfd = open(tmpath, O_RDWR | O_CREAT | O_TRUNC | O_EXCL, 0600);
+#endif
+    if (tfd < 0)
+        return NULL;
+
+    ok = inflate_to(st, tfd);
+    if (close(tfd) != 0)
+        ok = 0;
+
+    if (ok) {
+        cache_purge(dir, key);
+        ok = rename(tmpath, cpath) == 0;
+    }
+
+    if (!ok) {
+        unlink(tmpath);
+        return NULL;
+    }
+
+    DBGF("%s: inflated to %s\n", path, cpath);
+    return n_stream_open(cpath, "rb", TN_STREAM_STDIO);
+}
+
+/*
+  Cache of verified databases (tndb_verify()). Default entries are empty
+  files in cachedir/verified named sha1(db's absolute path).sha1(file's
+  identity and signature), entry of previous version of db is removed on
+  store.
+*/
+
+static int vrfy_lookup(const char *path, const char *key, void *arg);
+static void vrfy_store(const char *path, const char *key, void *arg);
+
+static const struct tndb_verify_cache vrfy_default = {
+    vrfy_lookup, vrfy_store, NULL
+};
+
+static struct tndb_verify_cache vrfy_cache = {
+    vrfy_lookup, vrfy_store, NULL
+};
+
+void tndb_set_verify_cache(const struct tndb_verify_cache *vc)
+{
+    vrfy_cache = vc ? *vc : vrfy_default;
+}
+
+/* lookups do not create anything, directories are created on store */
+static const char *vrfy_dir(char *buf, int size, int create)
+{
+    int n;
+
+    if (cachedir_path(buf, size) == NULL)
+        return NULL;
+
+    n = strlen(buf);
+    n_snprintf(buf + n, size - n, "/verified");
+    if (create && !mkdir_p(buf, 0700))
+        return NULL;
+
+    return buf;
+}
+
+static int vrfy_lookup(const char *path, const char *key, void *arg)
+{
+    char dir[PATH_MAX], epath[PATH_MAX + 128];
+
+    (void)path;
+    (void)arg;
+
+    if (vrfy_dir(dir, sizeof(dir), 0) == NULL)
+        return 0;
+
+    n_snprintf(epath, sizeof(epath), "%s/%s", dir, key);
+    return access(epath, F_OK) == 0;
+}
+
+static void vrfy_store(const char *path, const char *key, void *arg)
+{
+    char dir[PATH_MAX], epath[PATH_MAX + 128], prefix[64];
+    int  fd;
+
+    (void)path;
+    (void)arg;
+
+    if (vrfy_dir(dir, sizeof(dir), 1) == NULL)
+        return;
+
+    n_snprintf(prefix, sizeof(prefix), "%s", key);
+    *strchr(prefix, '.') = '\0';
+    cache_purge(dir, prefix);
+
+    n_snprintf(epath, sizeof(epath), "%s/%s", dir, key);
+    if ((fd = open(epath, O_WRONLY | O_CREAT, 0600)) >= 0)
+        close(fd);
+
+    DBGF("%s: verified as %s\n", path, epath);
+}
+
+static int vrfy_key(const struct tndb *db, char *key, int size)
+{
+    const struct tndb_sign *sign = &db->hdr.sign;
+    unsigned char          md[EVP_MAX_MD_SIZE];
+    unsigned               md_size = 0;
+    struct stat            st;
+    EVP_MD_CTX             *ctx;
+    int64_t                id[7];
+    int                    fd = -1, n, ok;
+
+    if (db->st->type == TN_STREAM_STDIO)
+        fd = fileno((FILE*)db->st->stream);
+
+    if ((fd >= 0 ? fstat(fd, &st) : stat(db->path, &st)) != 0)
+        return 0;
+
+    if (!cache_key(db->path, key, size))
+        return 0;
+
+    id[0] = st.st_dev;
+    id[1] = st.st_ino;
+    id[2] = st.st_size;
+    id[3] = st.st_mtime;
+    id[4] = st.st_ctime;
+#ifdef HAVE_STRUCT_STAT_ST_MTIM
+    id[5] = st.st_mtim.tv_nsec;
+    id[6] = st.st_ctim.tv_nsec;
+#else
+    id[5] = id[6] = 0;
+#endif
+
+    ctx = EVP_MD_CTX_create();
+    ok = EVP_DigestInit(ctx, EVP_sha1()) &&
+        EVP_DigestUpdate(ctx, id, sizeof(id)) &&
+        EVP_DigestUpdate(ctx, &db->hdr.flags, sizeof(db->hdr.flags)) &&
+        EVP_DigestUpdate(ctx, sign->md, sizeof(sign->md)) &&
+        EVP_DigestUpdate(ctx, sign->tmd, sizeof(sign->tmd)) &&
+        EVP_DigestFinal(ctx, md, &md_size);
+    EVP_MD_CTX_destroy(ctx);
+
+    if (!ok)
+        return 0;
+
+    n = strlen(key);
+    key[n++] = '.';
+    return tndb_bin2hex(key + n, size - n, md, md_size) > 0;
+}
+
+int tndb_verify_cached(const struct tndb *db)
+{
+    char key[128];
+
+    if (vrfy_cache.lookup == NULL || !vrfy_key(db, key, sizeof(key)))
+        return 0;
+
+    return vrfy_cache.lookup(db->path, key, vrfy_cache.arg);
+}
+
+void tndb_verify_cache_put(const struct tndb *db)
+{
+    char key[128];
+
+    if (vrfy_cache.store && vrfy_key(db, key, sizeof(key)))
+        vrfy_cache.store(db->path, key, vrfy_cache.arg);
+}
@@ -14,20 +14,25 @@
 # include "config.h"
 #endif
 
+#include <errno.h>
 #include <stdint.h>
 #include <unistd.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/types.h>
-#include <utime.h>
 #include <fcntl.h>
+#ifdef HAVE_MMAP
+# include <sys/mman.h>
+#endif
 
 #include <openssl/evp.h>
+#include <zlib.h>
 
 #include <trurl/nmalloc.h>
 #include <trurl/nassert.h>
 #include <trurl/n_snprintf.h>
+#include <trurl/n2h.h>
 
 #include "compiler.h"
 #include "tndb.h"
@@ -35,266 +40,578 @@
 
 //static char *msg_not_verified = "tndb: %s: refusing read unchecked file\n";
 
+static int mrkl_verify_index(struct tndb *db);
+static int vrfy_pending(struct tndb *db);
+
 static inline int verify_db(struct tndb *db)
 {
-    if (db->rtflags & TNDB_R_SIGN_VRFIED)
+    int rc = 1;
+
+    if (tndb_rtflags(db) & TNDB_R_SIGN_VRFIED)
         return 1;
 
-    if (db->hdr.flags & TNDB_SIGNED)
-        return tndb_verify(db);
+    if (db->vrfy)               /* being verified in background */
+        return vrfy_pending(db);
 
-    n_assert(0);
-    db->rtflags |= TNDB_R_SIGN_VRFIED;
-    return 1;
+    n_assert(db->hdr.flags & TNDB_SIGN_ANY);
+
+    tndb_lock(db);            /* recheck, another reader could verify it */
+    if ((db->rtflags & TNDB_R_SIGN_VRFIED) == 0) {
+        if ((db->hdr.xflags & TNDB_SIGN_MERKLE) && mrkl_verify_index(db))
+            rc = 1;
+        else
+            rc = tndb_verify(db);
+    }
+    tndb_unlock(db);
+
+    return rc;
 }
 
 
+/* reads from mapping, head read on open, file descriptor (pread(2) is
+   safe for concurrent readers) or, as the last resort, from db's stream */
 static
-int md5(FILE *stream, unsigned char *md, unsigned *md_size)
+int db_pread_raw(const struct tndb *db, void *buf, unsigned int size,
+                 uint32_t offs)
 {
-    unsigned char buf[1024 * 2000];
-    EVP_MD_CTX *ctx;
-    unsigned n, nn = 0;
+    int n;
 
-    n_assert(md_size && *md_size);
+    if (db->map) {
+        if (offs >= db->map_size)
+            return 0;
 
-    ctx = EVP_MD_CTX_create();
-    if (!EVP_DigestInit(ctx, EVP_md5())) {
-        EVP_MD_CTX_destroy(ctx);
-        return 0;
+        if (size > db->map_size - offs)
+            size = db->map_size - offs;
+
+        memcpy(buf, db->map + offs, size);
+        return size;
     }
 
-    while ((n = fread(buf, 1, sizeof(buf), stream)) > 0) {
-        EVP_DigestUpdate(ctx, buf, n);
-        nn += n;
+    if (offs < db->head_size && size <= db->head_size - offs) {
+        memcpy(buf, db->head + offs, size);
+        return size;
     }
 
-    EVP_DigestFinal(ctx, buf, &n);
+    if (db->fd >= 0)
+        return pread(db->fd, buf, size, offs);
+
+    tndb_lock(db);
+    n = nn_stream_read_offs(db->st, buf, size, offs);
+    tndb_unlock(db);
+
+    return n;
+}
+
+/* TNDB_SIGN_MERKLE: digests data chunk i and compares it with the table */
+static int mrkl_chunk_verify(const struct tndb *db, uint32_t i)
+{
+    unsigned char       md[TNDB_SIGN_TREE_MDSIZE], *buf = NULL;
+    const unsigned char *p;
+    uint32_t            offs = db->hdr.doffs + i * TNDB_SIGN_CHUNK;
+    int                 n, rc;
+
+    if (db->map) {
+        if (offs > db->map_size)
+            return 0;
+
+        p = db->map + offs;
+        n = db->map_size - offs;
+        if (n > TNDB_SIGN_CHUNK)
+            n = TNDB_SIGN_CHUNK;
 
-    if (n > *md_size) {
-        *md = '\0';
-        *md_size = 0;
     } else {
-        memcpy(md, buf, n);
-        *md_size = n;
+        p = buf = n_malloc(TNDB_SIGN_CHUNK);
+        if ((n = db_pread_raw(db, buf, TNDB_SIGN_CHUNK, offs)) < 0) {
+            free(buf);
+            return 0;
+        }
     }
 
-    EVP_MD_CTX_destroy(ctx);
+    rc = tndb_sign_chunk(p, n, md) &&
+        memcmp(md, db->mrkl + i * TNDB_SIGN_TREE_MDSIZE, sizeof(md)) == 0;
 
-    return *md_size;
+    DBGF("chunk %u at %u, %d bytes: %d\n", i, offs, n, rc);
+    free(buf);
+    return rc;
 }
 
-static
-int md5hex(FILE *stream, unsigned char *mdhex, unsigned *mdhex_size)
+/*
+  Verifies data chunks which [offs, offs + size) overlaps, on their first
+  access. Returns 0 if any of them is corrupted.
+*/
+static int mrkl_check(const struct tndb *db, uint32_t offs, unsigned int size)
 {
-    unsigned char md[128];
-    unsigned md_size = sizeof(md);
+    uint64_t end = (uint64_t)offs + size;
+    uint32_t i, last;
+
+    if (db->mrkl_ok == NULL || size == 0 || end <= db->hdr.doffs)
+        return 1;
+
+    if (offs < db->hdr.doffs)
+        offs = db->hdr.doffs;
 
-    if (md5(stream, md, &md_size)) {
-        int i, n = 0, nn = 0;
+    i = (offs - db->hdr.doffs) / TNDB_SIGN_CHUNK;
+    last = (end - 1 - db->hdr.doffs) / TNDB_SIGN_CHUNK;
+
+    for (; i <= last && i < db->hdr.mrkl_nchunks; i++) {
+        /* chunk could be verified by many threads at once, it is harmless */
+        if (__atomic_load_n(&db->mrkl_ok[i], __ATOMIC_ACQUIRE))
+            continue;
 
-        for (i=0; i < (int)md_size; i++) {
-            n = n_snprintf((char*)mdhex + nn, *mdhex_size - nn, "%02x", md[i]);
-            nn += n;
+        if (!mrkl_chunk_verify(db, i)) {
+            DBGF("%s: chunk %u is corrupted\n", db->path, i);
+            errno = EIO;
+            return 0;
         }
-        *mdhex_size = nn;
 
-    } else {
-        *mdhex = '\0';
-        *mdhex_size = 0;
+        __atomic_store_n(&db->mrkl_ok[i], 1, __ATOMIC_RELEASE);
     }
 
-    return *mdhex_size;
+    return 1;
+}
+
+/* returns pointer to size bytes at offs in db's mapping or NULL
+   if db is not mapped or the range is out of file */
+static inline
+const unsigned char *map_ptr(const struct tndb *db, uint32_t offs,
+                             unsigned int size)
+{
+    if (db->map == NULL || offs > db->map_size || size > db->map_size - offs)
+        return NULL;
+
+    if (db->mrkl_ok && !mrkl_check(db, offs, size))
+        return NULL;
+
+    return db->map + offs;
 }
 
 static
-time_t util_mtime(const char *path)
+int db_pread(const struct tndb *db, void *buf, unsigned int size,
+             uint32_t offs)
 {
-    struct stat st;
+    int n;
+
+    if ((n = db_pread_raw(db, buf, size, offs)) > 0 &&
+        db->mrkl_ok && !mrkl_check(db, offs, n))
+        return -1;
+
+    return n;
+}
+
+static int blkz_table_read(struct tndb *db)
+{
+    uint32_t i, size, offs;
+
+    size = (db->hdr.nblocks + 1) * sizeof(uint32_t);
+    if (db->hdr.nblocks >= UINT32_MAX / sizeof(uint32_t) ||
+        db->hdr.doffs < db->offs.htt + size)
+        goto l_einval;
 
-    if (stat(path, &st) != 0)
+    offs = db->hdr.doffs - size;
+    db->blkoffs = n_malloc(size);
+    if (db_pread(db, db->blkoffs, size, offs) != (int)size)
         return 0;
 
-    return st.st_mtime;
+    for (i=0; i <= db->hdr.nblocks; i++) {
+        db->blkoffs[i] = n_ntoh32(db->blkoffs[i]);
+
+        if (i == 0 ? db->blkoffs[i] != db->hdr.doffs :
+            db->blkoffs[i] <= db->blkoffs[i - 1])
+            goto l_einval;
+    }
+
+    return 1;
+
+ l_einval:
+    errno = EINVAL;
+    return 0;
 }
 
-#define DIGEST_SIZE_MD5  32
+/* inflates block no into db->blkbuf, db must be locked */
+static int blkz_load(struct tndb *db, uint32_t no)
+{
+    unsigned char *zbuf;
+    uint32_t      zlen;
+    uLongf        len;
+
+    if (db->blklen > 0 && db->blkno == no)
+        return 1;
+
+    if (db->blkbuf == NULL)
+        db->blkbuf = n_malloc(db->hdr.blksize);
+
+    db->blklen = 0;
+    zlen = db->blkoffs[no + 1] - db->blkoffs[no];
+    zbuf = n_malloc(zlen);
+
+    if (db_pread(db, zbuf, zlen, db->blkoffs[no]) == (int)zlen) {
+        len = db->hdr.blksize;
+        if (uncompress(db->blkbuf, &len, zbuf, zlen) == Z_OK && len > 0) {
+            db->blkno = no;
+            db->blklen = len;
+        }
+    }
+
+    DBGF("block %u: %u -> %u\n", no, zlen, db->blklen);
+    free(zbuf);
+    return db->blklen > 0;
+}
 
+/* reads uncompressed data, blocks are inflated as needed */
 static
-int make_md5(const char *dbpath)
+int blkz_read(const struct tndb *cdb, void *buf, unsigned int size,
+              uint32_t offs)
 {
-    FILE            *stream;
-    unsigned char   md[128];
-    char            path[PATH_MAX];
-    unsigned        md_size = sizeof(md);
+    struct tndb  *db = (struct tndb *)cdb; /* the block cache only */
+    unsigned int nread = 0;
+    uint32_t     pos;
 
-    if ((stream = fopen(dbpath, "r")) == NULL)
-        return 0;
+    tndb_lock(db);
+    pos = offs - db->hdr.doffs;
 
-    snprintf(path, sizeof(path), "%s.md5", dbpath);
+    while (size > 0) {
+        uint32_t no = pos / db->hdr.blksize, boffs = pos % db->hdr.blksize, n;
 
-    md5hex(stream, md, &md_size);
-    fclose(stream);
+        if (no >= db->hdr.nblocks || !blkz_load(db, no))
+            break;
 
-    if (md_size == DIGEST_SIZE_MD5) {
-        struct utimbuf ut;
-        FILE *f;
+        if (boffs >= db->blklen)
+            break;
 
-        if ((f = fopen(path, "w")) == NULL)
-            return 0;
-        fprintf(f, "%s", md);
-        fclose(f);
+        n = db->blklen - boffs;
+        if (n > size)
+            n = size;
 
-        ut.actime = ut.modtime = util_mtime(dbpath);
-        utime(path, &ut);
+        memcpy((unsigned char *)buf + nread, db->blkbuf + boffs, n);
+        nread += n;
+        pos += n;
+        size -= n;
     }
 
-    return md_size;
+    tndb_unlock(db);
+    return nread;
 }
 
+/* header and index are stored as is, TNDB_BLOCKZ data is not */
 static
-int verify_md5(const char *dbpath)
+int db_read_offs(const struct tndb *db, void *buf, unsigned int size,
+                 uint32_t offs)
 {
-    FILE            *stream;
-    unsigned char   md1[DIGEST_SIZE_MD5 + 1], md2[DIGEST_SIZE_MD5 + 1];
-    unsigned        md1_size, md2_size;
-    char            path[PATH_MAX];
-    int             fd;
+    if (db->blkoffs && offs >= db->hdr.doffs)
+        return blkz_read(db, buf, size, offs);
 
-    snprintf(path, sizeof(path), "%s.md5", dbpath);
+    return db_pread(db, buf, size, offs);
+}
 
-    /* check mtimes first */
-    time_t db_mtime = util_mtime(dbpath);
-    if (db_mtime > 0 && db_mtime == util_mtime(path))
-        return 1;
+/* record is stored as [klen(1byte)]key[vlen(4bytes)]value */
+#define REC_HDRSIZE(klen) (sizeof(uint8_t) + (klen) + sizeof(uint32_t))
 
-    if ((fd = open(path, O_RDONLY)) < 0)
-        return 0;
+/* enough for header of record with the longest key and a small value */
+#define REC_PROBESIZE     512
 
-    md2_size = read(fd, md2, sizeof(md2));
-    close(fd);
+/* backward seek on compressed stream means decompressing it from start */
+static inline int db_seekable(const struct tndb *db)
+{
+    return db->map || db->fd >= 0 || db->st->type == TN_STREAM_STDIO;
+}
 
-    if (md2_size != DIGEST_SIZE_MD5)
-        return 0;
+/*
+  Reads record of klen long key at offs with a single read into buf
+  (REC_PROBESIZE bytes) or points to it in db's mapping. Compressed
+  streams are read forward only, record header is read then.
+  Returns pointer to the record and number of bytes available at it.
+*/
+static
+const unsigned char *rec_probe(const struct tndb *db, uint32_t offs,
+                               unsigned int klen, unsigned char *buf,
+                               unsigned int *avail)
+{
+    int n, size;
 
-    if ((stream = fopen(dbpath, "r")) == NULL)
-        return 0;
+    *avail = 0;
+    if (db->map) {
+        if (offs >= db->map_size)
+            return NULL;
 
-    md1_size = sizeof(md1);
-    md5hex(stream, md1, &md1_size);
-    fclose(stream);
+        *avail = db->map_size - offs;
 
-#if ENABLE_TRACE
-    DBGF("md5 =\n %s\n %s\n => %d\n",
-         (char*)tndb_debug_bin2hex_s(md1, md1_size),
-         (char*)tndb_debug_bin2hex_s(md2, md2_size),
-         memcmp(md1, md2, md1_size));
-#endif
+        /* the record is checked by probe() if it is the one */
+        if (db->mrkl_ok && !mrkl_check(db, offs, REC_HDRSIZE(klen)))
+            return NULL;
 
-    int ok = (md1_size == DIGEST_SIZE_MD5 && md1_size == md2_size &&
-              memcmp(md1, md2, DIGEST_SIZE_MD5) == 0);
+        return db->map + offs;
+    }
+
+    if (db_seekable(db)) {
+        if ((n = db_read_offs(db, buf, REC_PROBESIZE, offs)) <= 0)
+            return NULL;
 
-    if (ok) {
-        struct utimbuf ut;
-        ut.actime = ut.modtime = db_mtime;
-        utime(path, &ut);
+        *avail = n;
+        return buf;
     }
 
-    return ok;
+    if (db_read_offs(db, buf, sizeof(uint8_t), offs) != sizeof(uint8_t))
+        return NULL;
+
+    *avail = sizeof(uint8_t);
+    if (buf[0] != klen)         /* not this one */
+        return buf;
+
+    size = REC_HDRSIZE(klen) - sizeof(uint8_t);
+    if ((n = db_read_offs(db, buf + 1, size, offs + 1)) <= 0)
+        return NULL;
+
+    *avail += n;
+    return buf;
 }
 
-static
-int read_eq(const struct tndb *db, const uint32_t offs,
-            const unsigned char *str, const uint32_t len)
+/* returns 1 if record at p holds key, 0 if not and -1 if it is truncated */
+static inline
+int rec_match(const unsigned char *p, unsigned int avail,
+              const void *key, unsigned int klen, uint32_t *vlen)
 {
-    unsigned char *buf;
+    uint32_t len;
 
-    if ((buf = alloca(len + 1)) == NULL)
+    if (avail < sizeof(uint8_t))
         return -1;
 
-    if (nn_stream_read_offs(db->st, buf, len, offs) != (int)len)
+    if (p[0] != klen) {
+        DBGF("db_klen %d, klen %d\n", p[0], klen);
+        return 0;
+    }
+
+    if (avail < REC_HDRSIZE(klen))
         return -1;
 
-    buf[len] = '\0';
-    DBGF("memcmp[%d] %s == %s ? %d\n", offs, buf, str,
-         memcmp(buf, str, len));
+    if (memcmp(p + sizeof(uint8_t), key, klen) != 0)
+        return 0;
+
+    memcpy(&len, p + sizeof(uint8_t) + klen, sizeof(len));
+    *vlen = n_ntoh32(len);
+    return 1;
+}
+
+/*
+  Reads header of record at offs into buf (REC_HDRSIZE(TNDB_KEY_MAX)
+  bytes) or points to it in db's mapping. Returns pointer to record's key.
+*/
+static
+const unsigned char *rec_head(const struct tndb *db, uint32_t offs,
+                              unsigned char *buf, uint8_t *klen, uint32_t *vlen)
+{
+    const unsigned char *p;
+    unsigned int        avail;
+    uint32_t            len;
+    int                 n;
+
+    if ((p = map_ptr(db, offs, sizeof(uint8_t))) != NULL) {
+        avail = db->map_size - offs;
+
+    } else {
+        if ((n = db_read_offs(db, buf, REC_HDRSIZE(TNDB_KEY_MAX), offs)) <= 0)
+            return NULL;
+
+        p = buf;
+        avail = n;
+    }
+
+    if (avail < REC_HDRSIZE(p[0]))
+        return NULL;
+
+    if (db->map && !mrkl_check(db, offs, REC_HDRSIZE(p[0])))
+        return NULL;
+
+    *klen = p[0];
+    memcpy(&len, p + sizeof(uint8_t) + *klen, sizeof(len));
+    *vlen = n_ntoh32(len);
 
-    return memcmp(buf, str, len) == 0;
+    return p + sizeof(uint8_t);
 }
 
+/*
+  Reads bucket offsets table only, buckets are loaded on demand by
+  htt_load_bucket(). Buckets are stored one after another as
+  [size][val, offs[, fp]]..., so bucket start in hents is computed from
+  its offset.
+*/
 static int htt_read(struct tndb *db)
 {
-    int i, j;
-    uint32_t ht_offsets[TNDB_HTSIZE];
+    int i, size = TNDB_HTBYTESIZE(&db->hdr);
+    uint32_t *ht_offsets, base, nents, esize, htsize = db->hdr.htsize;
+
+    ht_offsets = n_malloc(size);
+    if (db_read_offs(db, ht_offsets, size, db->offs.htt) != size)
+        goto l_err;
+
+    db->hidx = n_malloc((htsize + 1) * sizeof(*db->hidx));
+    base = db->offs.htt + size;
+    esize = TNDB_HENT_STORE_SIZE(&db->hdr);
+    nents = db->hdr.nrec;       /* every record has its hash entry */
+    db->hidx[htsize] = nents;
+
+    for (i = htsize - 1; i >= 0; i--) {
+        uint32_t ht_offs = n_ntoh32(ht_offsets[i]);
+
+        if (ht_offs != 0) {
+            uint32_t pos;
+
+            DBGF("h[%d] %d\n", i, ht_offs);
+            if (ht_offs < base + (i * sizeof(uint32_t)))
+                goto l_err;
+
+            pos = ht_offs - base - (i * sizeof(uint32_t));
+            if (pos % esize != 0)
+                goto l_err;
+
+            pos /= esize;
+            if (pos >= nents) {
+                DBGF("h[%d] broken offset %u\n", i, ht_offs);
+                goto l_err;
+            }
+            nents = pos;
+        }
 
-    /* read ht entries offsets first to avoid backward file seek */
+        db->hidx[i] = nents;
+    }
 
-    for (i=0; i < TNDB_HTSIZE; i++) {
-        uint32_t ht_offs, offs;
+    free(ht_offsets);
+    ht_offsets = NULL;
 
-        db->htt[i] = NULL;
-        ht_offsets[i] = 0;
+    if (nents != 0)
+        goto l_err;
 
-        offs = db->offs.htt + (sizeof(uint32_t) * i);
-        DBGF("h[%d] %d\n", i, offs);
-        if (!nn_stream_read_uint32_offs(db->st, &ht_offs, offs))
-            return 0;
+    db->hloaded = n_calloc(htsize, sizeof(*db->hloaded));
+    db->hents = n_malloc((db->hdr.nrec + 1) * sizeof(*db->hents));
+    if (db->hdr.xflags & TNDB_FPRINT)
+        db->hfps = n_malloc((db->hdr.nrec + 1) * sizeof(*db->hfps));
+
+    DBGF("htt_read DONE\n");
+    return 1;
+
+ l_err:
+    free(ht_offsets);
+    free(db->hidx);
+    db->hidx = NULL;
+    return 0;
+}
+
+/* splits [val, offs, fp] entries into hents and hfps */
+static int htt_load_bucket_fp(struct tndb *db, uint32_t i, uint32_t offs,
+                              uint32_t n)
+{
+    struct tndb_hent *hents = &db->hents[db->hidx[i]];
+    uint32_t *hfps = &db->hfps[db->hidx[i]], *buf, j;
+    int size = n * 3 * sizeof(uint32_t);
 
-        ht_offsets[i] = ht_offs;
+    buf = n_malloc(size);
+    if (db_read_offs(db, buf, size, offs) != size) {
+        free(buf);
+        return 0;
     }
 
-    for (i=0; i < TNDB_HTSIZE; i++) {
-        tn_array *ht = db->htt[i];
-        uint32_t ht_size;
-        uint32_t ht_offs = ht_offsets[i];
+    for (j=0; j < n; j++) {
+        hents[j].val = n_ntoh32(buf[3 * j]);
+        hents[j].offs = n_ntoh32(buf[3 * j + 1]);
+        hfps[j] = n_ntoh32(buf[3 * j + 2]);
+    }
 
-        if (ht_offs == 0)
-            continue;
+    free(buf);
+    return 1;
+}
 
-        DBGF("r[%d] %d\n", i, ht_offs);
-        if (!nn_stream_read_uint32_offs(db->st, &ht_size, ht_offs))
-            return 0;
+static int htt_load_bucket(struct tndb *db, uint32_t i)
+{
+    struct tndb_hent *hents;
+    uint32_t offs, n, j;
+    int      size;
 
-        if (ht_size == 0) {
-            DBGF("empty!? %d\n", i);
-            n_assert(0);
-            continue;
-        }
+    if (db->hloaded[i])
+        return 1;
 
-        if (ht == NULL) {
-            ht = n_array_new(ht_size, tndb_hent_free, (tn_fn_cmp)tndb_hent_cmp);
-            db->htt[i] = ht;
-        }
+    if ((n = db->hidx[i + 1] - db->hidx[i]) == 0) {
+        __atomic_store_n(&db->hloaded[i], 1, __ATOMIC_RELEASE);
+        return 1;
+    }
 
-        for (j=0; j < (int)ht_size; j++) {
-            uint32_t val, hoffs;
-            struct tndb_hent *he;
+    /* skip offsets table, preceding buckets and bucket size */
+    offs = db->offs.htt + TNDB_HTBYTESIZE(&db->hdr) +
+        ((i + 1) * sizeof(uint32_t)) +
+        (db->hidx[i] * TNDB_HENT_STORE_SIZE(&db->hdr));
 
-            if (!n_stream_read_uint32(db->st, &val))
-                return 0;
+    DBGF("r[%d] %d\n", i, offs);
+    if (db->hdr.xflags & TNDB_FPRINT) {
+        if (!htt_load_bucket_fp(db, i, offs, n))
+            return 0;
+        goto l_loaded;
+    }
 
-            if (!n_stream_read_uint32(db->st, &hoffs))
-                return 0;
+    /* whole bucket at once, entries are stored as val, offs pairs */
+    hents = &db->hents[db->hidx[i]];
+    size = n * sizeof(*hents);
 
-            DBGF("at %ld h0[%d].h1[%d](%d) %d\n",
-                 n_stream_tell(db->st) - (2 * sizeof(uint32_t)),
-                 i, j, val, hoffs);
+    if (db_read_offs(db, hents, size, offs) != size)
+        return 0;
 
-            he = tndb_hent_new(db, val, hoffs);
-            n_array_push(ht, he);
-        }
+    for (j=0; j < n; j++) {
+        hents[j].val = n_ntoh32(hents[j].val);
+        hents[j].offs = n_ntoh32(hents[j].offs);
+        DBGF("h0[%d].h1[%d](%d) %d\n", i, j, hents[j].val, hents[j].offs);
     }
 
-    DBGF("htt_read DONE\n");
+ l_loaded:
+    /* publish bucket to concurrent readers */
+    __atomic_store_n(&db->hloaded[i], 1, __ATOMIC_RELEASE);
     return 1;
 }
 
+/* makes sure bucket i is loaded, the table is shared by concurrent readers */
+static int htt_bucket(struct tndb *db, uint32_t i)
+{
+    int rc = 1;
+
+    /* hloaded is allocated by htt_read() */
+    if ((tndb_rtflags(db) & TNDB_R_HTT_LOADED) &&
+        __atomic_load_n(&db->hloaded[i], __ATOMIC_ACQUIRE))
+        return 1;
+
+    tndb_lock(db);
+    if ((db->rtflags & TNDB_R_HTT_LOADED) == 0) {
+        if ((rc = htt_read(db)))
+            tndb_rtflags_set(db, TNDB_R_HTT_LOADED);
+    }
+
+    if (rc)
+        rc = htt_load_bucket(db, i);
+    tndb_unlock(db);
+
+    return rc;
+}
+
+/* first entry in sorted hents[0..n) which val is not less than val */
+static inline
+const struct tndb_hent *hent_lower_bound(const struct tndb_hent *hents,
+                                         uint32_t n, uint32_t val)
+{
+    const struct tndb_hent *base = hents;
+
+    if (n == 0)
+        return hents;
+
+    while (n > 1) {
+        uint32_t half = n / 2;
+        base = (base[half].val < val) ? base + half : base;
+        n -= half;
+    }
+
+    return base + (base->val < val);
+}
+
 static
 int verify_digest(struct tndb_hdr *hdr, uint32_t htt_offset, tn_stream *st)
 {
-    unsigned char buf[4096];
+    unsigned char buf[1024 * 64];
     struct tndb_sign sign;
-    int rc, nread;
+    int rc, nread, to_read;
 
     sign = hdr->sign;
     tndb_sign_init(&hdr->sign);
@@ -306,23 +623,21 @@ int verify_digest(struct tndb_hdr *hdr, uint32_t htt_offset, tn_stream *st)
 
     tndb_hdr_compute_digest(hdr);
 
-    if ((hdr->flags & TNDB_NOHASH) == 0) { /* process hash table if any */
-        int to_read;
-
+    /* process hash table and TNDB_BLOCKZ offsets, if any */
+    to_read = hdr->doffs - htt_offset;
+    if (to_read > 0)
         n_stream_seek(st, htt_offset, SEEK_SET);
-        to_read = hdr->doffs - htt_offset;
 
-        while (to_read > 0) {
-            int n = sizeof(buf);
-            if (to_read < n)
-                n = to_read;
-            to_read -= n;
+    while (to_read > 0) {
+        int n = sizeof(buf);
+        if (to_read < n)
+            n = to_read;
+        to_read -= n;
 
-            if (n_stream_read(st, buf, n) != n)
-                return 0;
+        if (n_stream_read(st, buf, n) != n)
+            return 0;
 
-            tndb_sign_update(&hdr->sign, buf, n);
-        }
+        tndb_sign_update(&hdr->sign, buf, n);
     }
 
     tndb_sign_final(&hdr->sign);
@@ -340,199 +655,1049 @@ int verify_digest(struct tndb_hdr *hdr, uint32_t htt_offset, tn_stream *st)
     return rc;
 }
 
-static
-struct tndb *do_tndb_open(int fd, const char *path)
-{
-    struct tndb_hdr  hdr;
-    tn_stream        *st;
-    struct tndb      *db;
-    int              type;
+#define TREE_NTHREADS_MAX 16
 
-    type = tndb_detect_stream_type(path);
+/* chunks of TNDB_SIGN_TREE region digested by many threads */
+struct tree_job {
+    const unsigned char *base;
+    size_t              size;
+    uint32_t            nchunks;
+    uint32_t            next;   /* the next chunk to digest */
+    unsigned char       *mds;
+    int                 nerr;
+};
 
-    if (fd > 0)
-        st = n_stream_dopen(fd, "rb", type);
-    else
-        st = n_stream_open(path, "rb", type);
+static void *tree_worker(void *arg)
+{
+    struct tree_job *job = arg;
+    uint32_t        i;
 
-    if (st == NULL)
-        return NULL;
+    while ((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) <
+           job->nchunks) {
+        size_t offs = (size_t)i * TNDB_SIGN_CHUNK, len = TNDB_SIGN_CHUNK;
 
-    if (!tndb_hdr_restore(&hdr, st)) {
-        n_stream_close(st);
-        return NULL;
-    }
+        if (len > job->size - offs)
+            len = job->size - offs;
 
-#if 0                           /* disable => allow to load empty databases */
-    DBGF("hdr restored %d\n", hdr.nrec);
-    if (hdr.nrec <= 0) {
-        n_stream_close(st);
-        return NULL;
+        if (!tndb_sign_chunk(job->base + offs, len,
+                             job->mds + i * TNDB_SIGN_TREE_MDSIZE))
+            __atomic_add_fetch(&job->nerr, 1, __ATOMIC_RELAXED);
     }
-#endif
 
-    db = tndb_new(0);
-    db->offs.htt = n_stream_tell(st); /* just after the hdr */
-    db->path = n_strdup(path);
-    db->st = st;
-    db->rtflags = TNDB_R_MODE_R;
-    db->hdr = hdr;
+    return NULL;
+}
 
-    DBGF("nrec %u, doffs %u\n", hdr.nrec, hdr.doffs);
+/* digests chunks of mapped region in parallel and adds them to sign */
+static int tree_digest_mapped(struct tndb_sign *sign, const unsigned char *base,
+                              size_t size)
+{
+    pthread_t       threads[TREE_NTHREADS_MAX];
+    struct tree_job job;
+    long            nthreads;
+    int             i, n = 0;
 
-#if 0                           /* do lazy loading */
-    if ((hdr.flags & TNDB_NOHASH) == 0 &&
-        (db->rtflags & TNDB_R_HTT_LOADED) == 0) {
-        if (!htt_read(db))
-            n_die("htt_read failed\n");
-        db->rtflags |= TNDB_R_HTT_LOADED;
-    }
-#endif
+    if (size == 0)
+        return 1;
 
-    if ((db->hdr.flags & TNDB_SIGNED) == 0)
-        db->rtflags |= TNDB_R_SIGN_VRFIED;
+    memset(&job, 0, sizeof(job));
+    job.base = base;
+    job.size = size;
+    job.nchunks = (size + TNDB_SIGN_CHUNK - 1) / TNDB_SIGN_CHUNK;
+    job.mds = n_malloc(job.nchunks * TNDB_SIGN_TREE_MDSIZE);
 
-    return db;
-}
+    nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nthreads > TREE_NTHREADS_MAX)
+        nthreads = TREE_NTHREADS_MAX;
 
+    if (nthreads > job.nchunks)
+        nthreads = job.nchunks;
 
-struct tndb *tndb_open(const char *path)
-{
-    return do_tndb_open(-1, path);
-}
+    /* the caller is one of them */
+    for (i=1; i < nthreads; i++)
+        if (pthread_create(&threads[n], NULL, tree_worker, &job) == 0)
+            n++;
 
+    tree_worker(&job);
 
-struct tndb *tndb_dopen(int fd, const char *path)
-{
+    for (i=0; i < n; i++)
+        pthread_join(threads[i], NULL);
 
-    return do_tndb_open(fd, path);
-}
+    DBGF("%u chunks, %d threads, %d errors\n", job.nchunks, n + 1, job.nerr);
+    if (job.nerr == 0)
+        tndb_sign_add_chunks(sign, job.mds, job.nchunks);
 
+    free(job.mds);
+    return job.nerr == 0;
+}
 
-int tndb_verify(struct tndb *db)
+/* digests region of compressed stream chunk by chunk, up to EOF if size
+   is 0 */
+static int tree_digest_stream(struct tndb_sign *sign, tn_stream *st,
+                              uint32_t offs, uint32_t size)
 {
-    int rc = 0;
+    unsigned char *buf;
+    int           n = 0, bufsize = 64 * 1024, toeof = (size == 0), rc = 0;
 
-    if ((db->hdr.flags & TNDB_SIGN_DIGEST) == 0) { /* created w/o digest */
-        make_md5(db->path);
-    }
+    if (n_stream_seek(st, offs, SEEK_SET) == -1)
+        return 0;
 
-    db->rtflags |= TNDB_R_SIGN_VRFIED;
+    buf = n_malloc(bufsize);
+    while (toeof || size > 0) {
+        int len = bufsize;
 
-    if (verify_md5(db->path)) {
-        rc = 1;
-    } else if (verify_digest(&db->hdr, db->offs.htt, db->st)) {
-        make_md5(db->path);
+        if (!toeof && (uint32_t)len > size)
+            len = size;
+
+        if ((n = n_stream_read(st, buf, len)) <= 0)
+            break;
+
+        tndb_sign_update(sign, buf, n);
+        size -= n;
+    }
+
+    if (n >= 0 && (toeof || size == 0)) {
+        tndb_sign_region(sign);
         rc = 1;
     }
 
+    free(buf);
     return rc;
 }
 
-struct tndb *tndb_ref(struct tndb *db)
+/*
+  Verifies TNDB_SIGN_TREE signature, regions of uncompressed db are
+  digested over its mapping by as many threads as there are CPUs.
+*/
+static int verify_tree(struct tndb *db)
 {
-    db->_refcnt++;
-    return db;
-}
+    struct tndb_hdr     *hdr = &db->hdr;
+    struct tndb_sign    sign = hdr->sign;
+    const unsigned char *map = db->map;
+    size_t              map_size = db->map_size;
+    uint32_t            isize = hdr->doffs - db->offs.htt;
+    int                 rc = 0, mapped = 0;
+
+    if (hdr->doffs < db->offs.htt)
+        return 0;
 
-tn_stream *tndb_tn_stream(const struct tndb *db)
-{
-    return db->st;
-}
+#ifdef HAVE_MMAP
+    if (map == NULL && db->st->type == TN_STREAM_STDIO) {
+        int         fd = fileno((FILE*)db->st->stream);
+        struct stat st;
+        void        *p;
+
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+            if (p != MAP_FAILED) {
+                map = p;
+                map_size = st.st_size;
+                mapped = 1;
+            }
+        }
+    }
+#endif
 
-int tndb_get_voff(struct tndb *db, const void *key, unsigned int aklen,
-                  uint32_t *voffs, unsigned int *vlen)
-{
-    uint32_t                 hv, hv_i;
-    tn_array                 *ht;
-    struct tndb_hent         he_tmp, *he;
-    uint8_t                  klen;
-    int                      n, found = 0;
+    tndb_sign_init_tree(&hdr->sign);
 
+    /* the same order as writer's one: data, header and index */
+    if (map) {
+        if (map_size >= hdr->doffs &&
+            tree_digest_mapped(&hdr->sign, map + hdr->doffs,
+                               map_size - hdr->doffs)) {
+            tndb_hdr_compute_digest(hdr);
+            rc = tree_digest_mapped(&hdr->sign, map + db->offs.htt, isize);
+        }
 
-    if (!verify_db(db))
-        return 0;
+    } else if (tree_digest_stream(&hdr->sign, db->st, hdr->doffs, 0)) {
+        tndb_hdr_compute_digest(hdr);
+        rc = isize == 0 ||
+            tree_digest_stream(&hdr->sign, db->st, db->offs.htt, isize);
+    }
 
-    if (db->hdr.flags & TNDB_NOHASH)
-        n_die("tndb: method not allowed on file without hash table\n");
+    tndb_sign_final(&hdr->sign);
+    rc = rc && memcmp(sign.tmd, hdr->sign.tmd, sizeof(sign.tmd)) == 0;
+    hdr->sign = sign;
 
+#ifdef HAVE_MMAP
+    if (mapped)
+        munmap((void *)map, map_size);
+#endif
 
-    if ((db->rtflags & TNDB_R_HTT_LOADED) == 0) {
+    return rc;
+}
+
+/* reads whole compressed db into memory, it is served as mapping then */
+static
+int db_inflate(struct tndb *db)
+{
+    unsigned char *buf = NULL;
+    size_t        size = 0, asize = 0;
+    int           n;
+
+    if (n_stream_seek(db->st, 0, SEEK_SET) == -1)
+        return 0;
+
+    do {
+        if (asize - size < 64 * 1024) {
+            asize = asize ? asize * 2 : 1024 * 1024;
+            buf = n_realloc(buf, asize);
+        }
+
+        if ((n = n_stream_read(db->st, buf + size, asize - size)) > 0)
+            size += n;
+    } while (n > 0);
+
+    if (n < 0 || size == 0) {
+        free(buf);
+        return 0;
+    }
+
+    db->map = buf;
+    db->map_size = size;
+    db->map_anon = 1;
+    DBGF("%s inflated, %zu bytes\n", db->path, db->map_size);
+    return 1;
+}
+
+#ifdef HAVE_MMAP
+static
+int db_map(struct tndb *db)
+{
+    struct stat st;
+    void        *map;
+    int         fd;
+
+    fd = fileno((FILE*)db->st->stream);
+    if (fstat(fd, &st) != 0 || st.st_size <= 0)
+        return 0;
+
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED)
+        return 0;
+
+    db->map = map;
+    db->map_size = st.st_size;
+    DBGF("%s mapped, %zu bytes\n", db->path, db->map_size);
+    return 1;
+}
+#endif
+
+#define HEAD_READSIZE   (64 * 1024)
+
+/* reads from st until size bytes are read or EOF */
+static int stream_read_full(tn_stream *st, unsigned char *buf, int size)
+{
+    int n, nread = 0;
+
+    while (nread < size) {
+        if ((n = n_stream_read(st, buf + nread, size - nread)) < 0)
+            return -1;
+
+        if (n == 0)
+            break;
+        nread += n;
+    }
+
+    return nread;
+}
+
+/*
+  Reads leading HEAD_READSIZE bytes of db at once, header is decoded from
+  memory then and index which fits in them is loaded without further I/O;
+  bigger ones are still read by buckets, on demand, it is cheaper for
+  a few lookups. Returns the buffer (*size bytes) or NULL on error,
+  *hsize is set to header size.
+*/
+static
+unsigned char *head_read(tn_stream *st, struct tndb_hdr *hdr,
+                         uint32_t *size, int *hsize)
+{
+    unsigned char *buf;
+    int           n, rc, asize = HEAD_READSIZE;
+
+    if (n_stream_seek(st, 0, SEEK_SET) == -1)
+        return NULL;
+
+    buf = n_malloc(asize);
+    if ((n = stream_read_full(st, buf, asize)) < 0)
+        goto l_err;
+
+    /* header does not fit, it is not likely */
+    while ((rc = tndb_hdr_decode(hdr, buf, n)) < 0) {
+        int nn;
+
+        if (n < asize)          /* truncated */
+            goto l_err;
+
+        asize = -rc;
+        buf = n_realloc(buf, asize);
+        if ((nn = stream_read_full(st, buf + n, asize - n)) < 0)
+            goto l_err;
+        n += nn;
+    }
+
+    if (rc == 0)
+        goto l_err;
+
+    if (n < asize)              /* the whole file */
+        buf = n_realloc(buf, n > 0 ? n : 1);
+
+    DBGF("%d bytes, header %d, doffs %u\n", n, rc, hdr->doffs);
+    *hsize = rc;
+    *size = n;
+    return buf;
+
+ l_err:
+    free(buf);
+    return NULL;
+}
+
+static
+struct tndb *do_tndb_open(int fd, const char *path, unsigned flags)
+{
+    struct tndb_hdr  hdr;
+    tn_stream        *st;
+    struct tndb      *db;
+    unsigned char    *head;
+    uint32_t         head_size;
+    int              type, hsize;
+
+    type = tndb_detect_stream_type(path);
+
+    if (fd >= 0)
+        st = n_stream_dopen(fd, "rb", type);
+    else
+        st = n_stream_open(path, "rb", type);
+
+    if (st == NULL)
+        return NULL;
+
+    /* use inflated copy of compressed db, it is read as uncompressed one */
+    if ((flags & TNDB_O_INFLATE_CACHE) && st->type != TN_STREAM_STDIO) {
+        tn_stream *cst;
+
+        if ((cst = tndb_cache_inflated(st, fd, path)) != NULL) {
+            n_stream_close(st);
+            st = cst;
+        }
+    }
+
+    if ((head = head_read(st, &hdr, &head_size, &hsize)) == NULL) {
+        n_stream_close(st);
+        return NULL;
+    }
+
+#if 0                           /* disable => allow to load empty databases */
+    DBGF("hdr restored %d\n", hdr.nrec);
+    if (hdr.nrec <= 0) {
+        n_stream_close(st);
+        return NULL;
+    }
+#endif
+
+    db = tndb_new(0);
+    db->offs.htt = hsize;       /* just after the hdr */
+    db->head = head;
+    db->head_size = head_size;
+    db->path = n_strdup(path);
+    db->st = st;
+    db->rtflags = TNDB_R_MODE_R;
+    db->hdr = hdr;
+
+    DBGF("nrec %u, doffs %u\n", hdr.nrec, hdr.doffs);
+
+#if 0                           /* do lazy loading */
+    if ((hdr.flags & TNDB_NOHASH) == 0 &&
+        (db->rtflags & TNDB_R_HTT_LOADED) == 0) {
         if (!htt_read(db))
-            n_die("tndb: %p, htt_read failed\n", db);
-        //printf("tndb: %p, htt_read OK\n", db);
+            n_die("htt_read failed\n");
         db->rtflags |= TNDB_R_HTT_LOADED;
     }
+#endif
+
+    if ((db->hdr.flags & TNDB_SIGN_ANY) == 0)
+        db->rtflags |= TNDB_R_SIGN_VRFIED;
+
+    if ((db->hdr.xflags & TNDB_BLOCKZ) && !blkz_table_read(db)) {
+        tndb_free(db);
+        return NULL;
+    }
+
+#ifdef HAVE_MMAP
+    /* compressed streams cannot be mapped, read them as usual;
+       neither TNDB_BLOCKZ data could be served from the mapping */
+    if ((flags & TNDB_O_MMAP) && st->type == TN_STREAM_STDIO &&
+        (db->hdr.xflags & TNDB_BLOCKZ) == 0)
+        db_map(db);
+#endif
+
+    if ((flags & TNDB_O_INFLATE) && st->type != TN_STREAM_STDIO)
+        db_inflate(db);
+
+    if (db->map) {              /* head is served from the mapping too */
+        free(db->head);
+        db->head = NULL;
+        db->head_size = 0;
+    }
+
+    if (flags & TNDB_O_CONCURRENT) {
+        pthread_mutexattr_t attr;
+
+        /* positional reads for uncompressed files, compressed stream
+           reads are serialized */
+        if (st->type == TN_STREAM_STDIO)
+            db->fd = fileno((FILE*)st->stream);
+
+        pthread_mutexattr_init(&attr);
+        pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+
+        db->lock = n_malloc(sizeof(*db->lock));
+        pthread_mutex_init(db->lock, &attr);
+        pthread_mutexattr_destroy(&attr);
+    }
+
+    return db;
+}
+
+
+struct tndb *tndb_open(const char *path)
+{
+    return do_tndb_open(-1, path, 0);
+}
+
+
+struct tndb *tndb_dopen(int fd, const char *path)
+{
+
+    return do_tndb_open(fd, path, 0);
+}
+
+struct tndb *tndb_open_ex(const char *path, unsigned flags)
+{
+    return do_tndb_open(-1, path, flags);
+}
+
+struct tndb *tndb_dopen_ex(int fd, const char *path, unsigned flags)
+{
+    return do_tndb_open(fd, path, flags);
+}
+
+
+int tndb_verify(struct tndb *db)
+{
+    int rc = 0;
+
+    if (db->vrfy)               /* being verified in background */
+        return tndb_verify_wait(db);
+
+    tndb_lock(db);
+
+    if ((db->hdr.flags & TNDB_SIGN_ANY) == 0) { /* nothing to verify */
+        rc = 1;
+        goto l_end;
+    }
+
+    /* verified before and not modified since */
+    if (tndb_verify_cached(db)) {
+        rc = 1;
+        goto l_end;
+    }
+
+    if (db->hdr.flags & TNDB_SIGN_TREE)
+        rc = verify_tree(db);
+    else
+        rc = verify_digest(&db->hdr, db->offs.htt, db->st);
+
+    if (rc)
+        tndb_verify_cache_put(db);
+
+ l_end:
+    tndb_rtflags_set(db, TNDB_R_SIGN_VRFIED);
+    tndb_unlock(db);
+
+    return rc;
+}
+
+/* tndb_verify_async() job */
+struct tndb_vrfy {
+    pthread_t       thread;
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    unsigned        flags;
+    int             rc;         /* -1 until done */
+    void            (*done_fn)(struct tndb *db, int ok, void *arg);
+    void            *arg;
+    struct tndb     *db;
+    struct stat     st;         /* db's file */
+    int             st_ok;
+};
+
+/* fstat(2) of file read by stream */
+static int stream_fstat(tn_stream *st, struct stat *stbuf)
+{
+    int fd = st->fd;
+
+    if (st->type == TN_STREAM_STDIO)
+        fd = fileno((FILE*)st->stream);
+
+    return fd >= 0 && fstat(fd, stbuf) == 0;
+}
+
+/* verifies own handle of db's file, db's stream is left for lookups */
+static void *vrfy_worker(void *arg)
+{
+    struct tndb_vrfy       *job = arg;
+    struct tndb            *db = job->db, *vdb;
+    const struct tndb_sign *sign = &db->hdr.sign;
+    struct stat            stbuf;
+    unsigned               oflags = 0;
+    int                    rc = 0;
+
+    /* db reads inflated copy of compressed file, verify the copy */
+    if (db->st->type == TN_STREAM_STDIO &&
+        tndb_detect_stream_type(db->path) != TN_STREAM_STDIO)
+        oflags |= TNDB_O_INFLATE_CACHE;
+
+    if ((vdb = tndb_open_ex(db->path, oflags)) != NULL) {
+        /* path could be replaced meanwhile, it must be db's file */
+        if (job->st_ok && stream_fstat(vdb->st, &stbuf) &&
+            stbuf.st_dev == job->st.st_dev && stbuf.st_ino == job->st.st_ino &&
+            vdb->hdr.doffs == db->hdr.doffs && vdb->hdr.nrec == db->hdr.nrec &&
+            memcmp(vdb->hdr.sign.md, sign->md, sizeof(sign->md)) == 0 &&
+            memcmp(vdb->hdr.sign.tmd, sign->tmd, sizeof(sign->tmd)) == 0)
+            rc = tndb_verify(vdb);
+
+        tndb_close(vdb);
+    }
+
+    DBGF("%s: %d\n", db->path, rc);
+
+    /* db's rtflags are left to lookups, result is kept by the job */
+    pthread_mutex_lock(&job->lock);
+    __atomic_store_n(&job->rc, rc, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&job->cond);
+    pthread_mutex_unlock(&job->lock);
+
+    if (job->done_fn)
+        job->done_fn(db, rc, job->arg);
+
+    return NULL;
+}
+
+/* lookup made while db is verified in background */
+static int vrfy_pending(struct tndb *db)
+{
+    int rc = __atomic_load_n(&db->vrfy->rc, __ATOMIC_ACQUIRE);
+
+    if (rc >= 0)
+        return rc;
+
+    if (db->vrfy->flags & TNDB_VA_READ)
+        return 1;
+
+    return tndb_verify_wait(db);
+}
+
+int tndb_verify_async(struct tndb *db, unsigned flags,
+                      void (*done)(struct tndb *db, int ok, void *arg),
+                      void *arg)
+{
+    struct tndb_vrfy *job;
+
+    if ((tndb_rtflags(db) & TNDB_R_MODE_R) == 0 || db->vrfy) {
+        errno = EINVAL;
+        return 0;
+    }
+
+    if (tndb_rtflags(db) & TNDB_R_SIGN_VRFIED) { /* unsigned or verified */
+        if (done)
+            done(db, 1, arg);
+        return 1;
+    }
+
+    job = n_calloc(1, sizeof(*job));
+    job->flags = flags;
+    job->rc = -1;
+    job->done_fn = done;
+    job->arg = arg;
+    job->db = db;
+    job->st_ok = stream_fstat(db->st, &job->st);
+    pthread_mutex_init(&job->lock, NULL);
+    pthread_cond_init(&job->cond, NULL);
+
+    db->vrfy = job;             /* before done_fn could see db */
+    if (pthread_create(&job->thread, NULL, vrfy_worker, job) != 0) {
+        db->vrfy = NULL;
+        pthread_cond_destroy(&job->cond);
+        pthread_mutex_destroy(&job->lock);
+        free(job);
+        return 0;
+    }
+
+    return 1;
+}
+
+int tndb_verify_poll(struct tndb *db)
+{
+    if (db->vrfy)
+        return __atomic_load_n(&db->vrfy->rc, __ATOMIC_ACQUIRE);
+
+    return (tndb_rtflags(db) & TNDB_R_SIGN_VRFIED) ? 1 : -1;
+}
+
+int tndb_verify_wait(struct tndb *db)
+{
+    struct tndb_vrfy *job = db->vrfy;
+    int              rc;
+
+    if (job == NULL)
+        return tndb_verify(db);
+
+    pthread_mutex_lock(&job->lock);
+    while (job->rc < 0)
+        pthread_cond_wait(&job->cond, &job->lock);
+    rc = job->rc;
+    pthread_mutex_unlock(&job->lock);
+
+    return rc;
+}
+
+void tndb_vrfy_free(struct tndb *db)
+{
+    struct tndb_vrfy *job = db->vrfy;
+
+    pthread_join(job->thread, NULL);
+    pthread_cond_destroy(&job->cond);
+    pthread_mutex_destroy(&job->lock);
+    free(job);
+    db->vrfy = NULL;
+}
+
+struct tndb *tndb_ref(struct tndb *db)
+{
+    db->_refcnt++;
+    return db;
+}
+
+tn_stream *tndb_tn_stream(const struct tndb *db)
+{
+    return db->st;
+}
+
+/* TNDB_MPHF: reads displacements and slots */
+static int mph_read(struct tndb *db)
+{
+    uint32_t nb = db->hdr.mph_nbuckets, nk = db->hdr.mph_nkeys, i, offs;
+    uint32_t *buf;
+    int      size;
+
+    offs = db->offs.htt;
+    size = nb * sizeof(uint32_t);
+    if ((uint64_t)offs + size + (uint64_t)nk * 2 * sizeof(uint32_t) > UINT32_MAX)
+        return 0;
+
+    db->mphdisp = n_malloc((nb + 1) * sizeof(*db->mphdisp));
+    if (db_read_offs(db, db->mphdisp, size, offs) != size)
+        return 0;
+
+    for (i=0; i < nb; i++)
+        db->mphdisp[i] = n_ntoh32(db->mphdisp[i]);
+
+    offs += size;
+    db->mphoffs = n_malloc((nk + 1) * sizeof(*db->mphoffs));
+
+    if ((db->hdr.xflags & TNDB_FPRINT) == 0) {
+        size = nk * sizeof(uint32_t);
+        if (db_read_offs(db, db->mphoffs, size, offs) != size)
+            return 0;
+
+        for (i=0; i < nk; i++)
+            db->mphoffs[i] = n_ntoh32(db->mphoffs[i]);
+
+        return 1;
+    }
+
+    /* [offs, fp] slots */
+    size = nk * 2 * sizeof(uint32_t);
+    buf = n_malloc(size + 1);
+    if (db_read_offs(db, buf, size, offs) != size) {
+        free(buf);
+        return 0;
+    }
+
+    db->hfps = n_malloc((nk + 1) * sizeof(*db->hfps));
+    for (i=0; i < nk; i++) {
+        db->mphoffs[i] = n_ntoh32(buf[2 * i]);
+        db->hfps[i] = n_ntoh32(buf[2 * i + 1]);
+    }
+
+    free(buf);
+    return 1;
+}
+
+static int mph_load(struct tndb *db)
+{
+    int rc = 1;
+
+    if (tndb_rtflags(db) & TNDB_R_HTT_LOADED)
+        return 1;
+
+    tndb_lock(db);
+    if ((db->rtflags & TNDB_R_HTT_LOADED) == 0) {
+        if ((rc = mph_read(db)))
+            tndb_rtflags_set(db, TNDB_R_HTT_LOADED);
+    }
+    tndb_unlock(db);
+
+    return rc;
+}
+
+/* sections stored between hash table and data, in file order */
+static uint64_t tail_sect_size(const struct tndb *db, unsigned flag)
+{
+    if ((db->hdr.xflags & flag) == 0)
+        return 0;
+
+    switch (flag) {
+        case TNDB_BLOOM:
+            return (uint64_t)db->hdr.bloom_nblocks * TNDB_BLOOM_BLKSIZE;
+
+        case TNDB_KEYIDX:
+            return (uint64_t)db->hdr.kidx_nkeys * sizeof(uint32_t);
+
+        case TNDB_ORDIDX:
+            return (uint64_t)db->hdr.nrec * sizeof(uint32_t);
+
+        case TNDB_SIGN_MERKLE:
+            return (uint64_t)db->hdr.mrkl_nchunks * TNDB_SIGN_TREE_MDSIZE;
+
+        case TNDB_BLOCKZ:
+            return ((uint64_t)db->hdr.nblocks + 1) * sizeof(uint32_t);
+    }
+
+    n_assert(0);
+    return 0;
+}
+
+/* returns offset of section, 0 if sections do not fit before data */
+static uint32_t tail_sect_offs(const struct tndb *db, unsigned flag)
+{
+    static const unsigned order[] = { TNDB_BLOCKZ, TNDB_SIGN_MERKLE,
+                                      TNDB_ORDIDX, TNDB_KEYIDX, TNDB_BLOOM };
+    int64_t offs = db->hdr.doffs;
+    unsigned i;
+
+    for (i=0; i < sizeof(order) / sizeof(order[0]); i++) {
+        offs -= tail_sect_size(db, order[i]);
+        if (order[i] == flag)
+            break;
+    }
+
+    if (offs < (int64_t)db->offs.htt)
+        return 0;
+
+    return offs;
+}
+
+/*
+  TNDB_SIGN_MERKLE: verifies header, index and table of data chunks'
+  digests against tree signature, data chunks are verified on their first
+  access then. Compressed streams could not be read by chunks, they are
+  verified as a whole.
+*/
+static int mrkl_verify_index(struct tndb *db)
+{
+    struct tndb_hdr  *hdr = &db->hdr;
+    struct tndb_sign sign = hdr->sign;
+    unsigned char    *table, *buf;
+    uint32_t         offs, size, n;
+    int              rc = 0;
+
+    if (!db_seekable(db))
+        return 0;
+
+    if ((offs = tail_sect_offs(db, TNDB_SIGN_MERKLE)) == 0)
+        return 0;
+
+    size = hdr->mrkl_nchunks * TNDB_SIGN_TREE_MDSIZE;
+    table = n_malloc(size ? size : 1);
+    if (db_pread_raw(db, table, size, offs) != (int)size) {
+        free(table);
+        return 0;
+    }
+
+    /* the same order as writer's one: data, header and index */
+    tndb_sign_init_tree(&hdr->sign);
+    tndb_sign_add_chunks(&hdr->sign, table, hdr->mrkl_nchunks);
+    tndb_hdr_compute_digest(hdr);
+
+    buf = n_malloc(TNDB_SIGN_CHUNK);
+    for (offs = db->offs.htt; offs < hdr->doffs; offs += n) {
+        n = hdr->doffs - offs;
+        if (n > TNDB_SIGN_CHUNK)
+            n = TNDB_SIGN_CHUNK;
+
+        if (db_pread_raw(db, buf, n, offs) != (int)n)
+            break;
+
+        tndb_sign_update(&hdr->sign, buf, n);
+    }
+    free(buf);
+
+    tndb_sign_final(&hdr->sign);
+    rc = offs >= hdr->doffs &&
+        memcmp(sign.tmd, hdr->sign.tmd, sizeof(sign.tmd)) == 0;
+    hdr->sign = sign;
+
+    DBGF("%s: %u chunks, %d\n", db->path, hdr->mrkl_nchunks, rc);
+    if (!rc) {
+        free(table);
+        return 0;
+    }
+
+    db->mrkl = table;
+    db->mrkl_ok = n_calloc(hdr->mrkl_nchunks + 1, sizeof(*db->mrkl_ok));
+    tndb_rtflags_set(db, TNDB_R_SIGN_VRFIED);
+    return 1;
+}
+
+static int bloom_read(struct tndb *db)
+{
+    uint32_t size, offs;
+
+    size = db->hdr.bloom_nblocks * TNDB_BLOOM_BLKSIZE;
+    if ((offs = tail_sect_offs(db, TNDB_BLOOM)) == 0) {
+        errno = EINVAL;
+        return 0;
+    }
+
+    if ((db->bloom = map_ptr(db, offs, size)) != NULL)
+        return 1;
+
+    db->bloombuf = n_malloc(size);
+    if (db_pread(db, db->bloombuf, size, offs) != (int)size)
+        return 0;
+
+    db->bloom = db->bloombuf;
+    return 1;
+}
+
+/* returns 0 if key is surely absent, the filter is loaded on first use */
+static int bloom_maybe(struct tndb *db, const struct tndb_khash *kh)
+{
+    if ((db->hdr.xflags & TNDB_BLOOM) == 0)
+        return 1;
+
+    if ((tndb_rtflags(db) & TNDB_R_BLOOM_LOADED) == 0) {
+        int rc = 1;
+
+        tndb_lock(db);
+        if ((db->rtflags & TNDB_R_BLOOM_LOADED) == 0) {
+            if ((rc = bloom_read(db)))
+                tndb_rtflags_set(db, TNDB_R_BLOOM_LOADED);
+        }
+        tndb_unlock(db);
+
+        if (!rc)
+            n_die("tndb: %p, bloom_read failed\n", db);
+    }
+
+    return tndb_bloom_test(db->bloom, db->hdr.bloom_nblocks, kh->hv, kh->hv2);
+}
+
+/* TNDB_MPHF: returns offset of the only record key could be, 0 if none */
+static uint32_t mph_find(struct tndb *db, const struct tndb_khash *kh,
+                         uint8_t klen)
+{
+    uint32_t h[3], slot;
+
+    if (!mph_load(db))
+        n_die("tndb: %p, mph_read failed\n", db);
+
+    if (db->hdr.mph_nkeys == 0)
+        return 0;
+
+    tndb_mph_hash(kh->hv, kh->hv2, db->hdr.mph_seed, h);
+    slot = tndb_mph_slot(h, db->mphdisp[h[0] % db->hdr.mph_nbuckets],
+                         db->hdr.mph_nkeys);
+
+    if (db->hfps && db->hfps[slot] != TNDB_KH_FP(kh, klen))
+        return 0;
+
+    DBGF("slot %u, offs %u\n", slot, db->mphoffs[slot]);
+    return db->mphoffs[slot];
+}
+
+/*
+  Probes record at offs, a single read of REC_PROBESIZE bytes. If it
+  holds key and its value fits in that read as well *valp is set to point
+  to it (in buf or in the mapping).
+  Returns 1 if found, 0 if not and -1 on error.
+*/
+static
+int probe(struct tndb *db, uint32_t offs, const void *key, uint8_t klen,
+          uint32_t *voffs, unsigned int *vlen,
+          unsigned char *buf, const unsigned char **valp)
+{
+    const unsigned char *p;
+    unsigned int        avail;
+    uint32_t            len;
+    int                 rc;
+
+    if (valp)                   /* buf is to be overwritten */
+        *valp = NULL;
+
+    if ((p = rec_probe(db, offs, klen, buf, &avail)) == NULL)
+        return -1;
+
+    if ((rc = rec_match(p, avail, key, klen, &len)) <= 0)
+        return rc;
+
+    /* mapped one is not read through db_pread() */
+    if (db->map && !mrkl_check(db, offs, REC_HDRSIZE(klen) + len))
+        return -1;
+
+    *voffs = offs + REC_HDRSIZE(klen);
+    *vlen = len;
+
+    if (valp && avail - REC_HDRSIZE(klen) >= len)
+        *valp = p + REC_HDRSIZE(klen);
+
+    return 1;
+}
+
+/* finds record of key, see probe() */
+static
+int lookup(struct tndb *db, const void *key, unsigned int aklen,
+           uint32_t *voffs, unsigned int *vlen,
+           unsigned char *buf, const unsigned char **valp)
+{
+    struct tndb_khash        kh;
+    uint32_t                 hv, hv_i, fp = 0, offs;
+    const struct tndb_hent   *he, *end;
+    uint8_t                  klen;
+    int                      found = 0;
+
+
+    if (!verify_db(db))
+        return 0;
+
+    if (db->hdr.flags & TNDB_NOHASH)
+        n_die("tndb: method not allowed on file without hash table\n");
 
     *voffs = 0;
     *vlen = 0;
+    if (valp)
+        *valp = NULL;
 
     if (aklen > UINT8_MAX)
         n_die("tndb: key too long (max is %d)\n", UINT8_MAX);
 
     klen = aklen;
 
-    hv = tndb_hash(key, klen);
-    hv_i = hv & 0xff;
-    ht = db->htt[hv_i];
-
-    if (ht == NULL)
+    tndb_key_hash(&db->hdr, key, klen, &kh);
+    if (!bloom_maybe(db, &kh))
         return 0;
 
-    he_tmp.val = hv;
-    he_tmp.offs = 0;
+    if (db->hdr.xflags & TNDB_MPHF) {
+        if ((offs = mph_find(db, &kh, klen)) == 0)
+            return 0;
+
+        return probe(db, offs, key, klen, voffs, vlen, buf, valp);
+    }
 
-    DBGF("search[%u] %u\n", hv_i, hv);
-    if ((n = n_array_bsearch_idx(ht, &he_tmp)) == -1)
-        return 0;
+    hv = kh.hv;
+    hv_i = kh.hb & (db->hdr.htsize - 1);
 
-    DBGF("search[%u] %u -> %d\n", hv_i, hv, n);
-    while (n < n_array_size(ht)) {
-        uint8_t db_klen = 0;
+    if (db->hdr.xflags & TNDB_FPRINT)
+        fp = TNDB_KH_FP(&kh, klen);
 
-        he = n_array_nth(ht, n++);
+    if (!htt_bucket(db, hv_i))
+        n_die("tndb: %p, htt_read failed\n", db);
+
+    he = &db->hents[db->hidx[hv_i]];
+    end = &db->hents[db->hidx[hv_i + 1]];
+
+    DBGF("search[%u] %u\n", hv_i, hv);
+    he = hent_lower_bound(he, end - he, hv);
+
+    /* the last one wins if key is duplicated */
+    for (; he < end; he++) {
+        int rc;
 
         DBGF("search[%u] %u: %u, %u\n", hv_i, hv, he->val, he->offs);
         if (he->val != hv)
             break;
 
-        if (nn_stream_read_offs(db->st, &db_klen, 1, he->offs) != 1) {
+        if (fp && db->hfps[he - db->hents] != fp) /* surely not this one */
+            continue;
+
+        if ((rc = probe(db, he->offs, key, klen, voffs, vlen, buf, valp)) < 0) {
             found = -1;
             break;
         }
 
-        if (db_klen != klen) {
-            DBGF("db_klen %d, klen %d\n", db_klen, klen);
-            continue;
-        }
-
-        if (read_eq(db, he->offs + sizeof(klen), key, klen)) {
-            uint32_t len;
+        if (rc > 0)
             found = 1;
-
-            *voffs = he->offs + sizeof(uint8_t) + klen;
-            if (nn_stream_read_uint32_offs(db->st, &len, *voffs))
-                *vlen = len;
-            else
-                found = -1;
-            *voffs += sizeof(uint32_t);
-        }
     }
 
     return found;
 }
 
+int tndb_get_voff(struct tndb *db, const void *key, unsigned int aklen,
+                  uint32_t *voffs, unsigned int *vlen)
+{
+    unsigned char buf[REC_PROBESIZE];
+
+    return lookup(db, key, aklen, voffs, vlen, buf, NULL);
+}
+
+int tndb_get_ref(struct tndb *db, const void *key, unsigned int klen,
+                 const void **val, unsigned int *vlen)
+{
+    const unsigned char *p;
+    uint32_t            voffs;
+    int                 rc;
+
+    *val = NULL;
+    if (db->map == NULL)
+        return -1;
+
+    if ((rc = tndb_get_voff(db, key, klen, &voffs, vlen)) <= 0)
+        return rc;
+
+    if ((p = map_ptr(db, voffs, *vlen)) == NULL)
+        return -1;
+
+    *val = p;
+    return 1;
+}
+
 int tndb_get(struct tndb *db, const void *key, unsigned int klen,
              void *val, unsigned int valsize)
 {
-    uint32_t     voffs;
-    unsigned int vlen;
-    int          nread = 0;
+    unsigned char       buf[REC_PROBESIZE];
+    const unsigned char *valp;
+    uint32_t            voffs;
+    unsigned int        vlen;
+    int                 nread = 0;
+
+    /* cached values must not outlive failed verification either */
+    if (!verify_db(db))
+        return 0;
+
+    if ((nread = tndb_vcache_get(db, key, klen, val, valsize, NULL)) >= 0)
+        return (unsigned)nread < valsize ? nread : 0;
 
-    if (tndb_get_voff(db, key, klen, &voffs, &vlen) && vlen < valsize) {
-        nread = nn_stream_read_offs(db->st, val, vlen, voffs);
-        if (nread != (int)vlen)
-            nread = 0;
+    nread = 0;
+    if (lookup(db, key, klen, &voffs, &vlen, buf, &valp) > 0 && vlen < valsize) {
+        if (valp)
+            memcpy(val, valp, vlen);
+        else if (db_read_offs(db, val, vlen, voffs) != (int)vlen)
+            return 0;
+
+        nread = vlen;
+        tndb_vcache_put(db, key, klen, val, vlen);
     }
 
     return nread;
@@ -541,18 +1706,35 @@ int tndb_get(struct tndb *db, const void *key, unsigned int klen,
 size_t tndb_get_all(struct tndb *db, const void *key, size_t klen,
 		    void **val)
 {
+    unsigned char buf[REC_PROBESIZE];
+    const unsigned char *valp;
     uint32_t voffs;
     size_t nread = 0;
     unsigned int vlen;
+    int cached;
+
+    if (!verify_db(db))
+        return 0;
+
+    if ((cached = tndb_vcache_get(db, key, klen, NULL, 0, val)) >= 0)
+        return cached;
 
-    if (tndb_get_voff(db, key, klen, &voffs, &vlen)) {
+    if (lookup(db, key, klen, &voffs, &vlen, buf, &valp) > 0) {
 	*val = n_malloc(vlen + 1); /* extra byte for \0 */
 
-	nread = nn_stream_read_offs(db->st, *val, vlen, voffs);
+	if (valp) {
+	    memcpy(*val, valp, vlen);
+	    tndb_vcache_put(db, key, klen, *val, vlen);
+	    return vlen;
+	}
+
+	nread = db_read_offs(db, *val, vlen, voffs);
 
 	if (nread != vlen) {
 	    nread = 0;
 	    n_cfree(val);
+	} else {
+	    tndb_vcache_put(db, key, klen, *val, vlen);
 	}
     }
 
@@ -570,6 +1752,286 @@ int tndb_get_str(struct tndb *db, const char *key,
     return nread;
 }
 
+/* tndb_mget() */
+struct mget_cand {
+    uint32_t offs;              /* record offset */
+    uint32_t i;                 /* key index */
+};
+
+static int mget_cand_cmp(const void *a, const void *b)
+{
+    const struct mget_cand *c1 = a, *c2 = b;
+
+    if (c1->offs != c2->offs)
+        return c1->offs < c2->offs ? -1 : 1;
+
+    return c1->i < c2->i ? -1 : (c1->i > c2->i);
+}
+
+#define MGET_WINDOW     (64 * 1024) /* read-ahead window size */
+#define MGET_SLACK      512         /* extra bytes read for small values */
+
+struct mget_win {
+    unsigned char *buf;
+    uint32_t      offs;
+    unsigned int  len;
+};
+
+/*
+  Returns pointer to record cands[k] and number of bytes available at it.
+  Records of next candidates which fit in the window are read at once
+  unless db is a compressed stream.
+*/
+static
+const unsigned char *mget_win_get(const struct tndb *db, struct mget_win *win,
+                                  const struct mget_cand *cands,
+                                  unsigned int k, unsigned int ncands,
+                                  const unsigned int *klens,
+                                  unsigned int *avail)
+{
+    uint32_t offs = cands[k].offs, end;
+    unsigned int j, len;
+    int n;
+
+    if (db->map || !db_seekable(db))
+        return rec_probe(db, offs, klens[cands[k].i], win->buf, avail);
+
+    end = offs + REC_HDRSIZE(klens[cands[k].i]);
+
+    if (win->len > 0 && offs >= win->offs && end <= win->offs + win->len) {
+        *avail = win->offs + win->len - offs;
+        return win->buf + (offs - win->offs);
+    }
+
+    for (j = k + 1; j < ncands; j++) {
+        uint32_t e = cands[j].offs + REC_HDRSIZE(klens[cands[j].i]);
+
+        if (e - offs > MGET_WINDOW)
+            break;
+
+        if (e > end)
+            end = e;
+    }
+
+    len = end - offs + MGET_SLACK;
+    if (len > MGET_WINDOW)
+        len = MGET_WINDOW;
+
+    win->len = 0;
+    if ((n = db_read_offs(db, win->buf, len, offs)) <= 0)
+        return NULL;
+
+    win->offs = offs;
+    win->len = n;
+
+    *avail = n;
+    return win->buf;
+}
+
+static int uint32_cmp(const void *a, const void *b)
+{
+    uint32_t v1 = *(const uint32_t *)a, v2 = *(const uint32_t *)b;
+
+    return v1 < v2 ? -1 : (v1 > v2 ? 1 : 0);
+}
+
+/* candidates of keys found in hash table */
+static
+struct mget_cand *mget_cands_htt(struct tndb *db, unsigned int n,
+                                 const char **keys, const unsigned int *klens,
+                                 unsigned int *ncands)
+{
+    struct mget_cand  *cands = NULL;
+    struct tndb_khash *khs;
+    uint32_t          *buckets, mask = db->hdr.htsize - 1;
+    uint8_t           *maybe;
+    unsigned int      i, nb, acands = 0;
+
+    khs = n_malloc((n + 1) * sizeof(*khs));
+    buckets = n_malloc((n + 1) * sizeof(*buckets));
+    maybe = n_malloc(n + 1);
+
+    for (i = 0, nb = 0; i < n; i++) {
+        tndb_key_hash(&db->hdr, keys[i], klens[i], &khs[i]);
+
+        if ((maybe[i] = bloom_maybe(db, &khs[i])))
+            buckets[nb++] = khs[i].hb & mask;
+    }
+
+    /* touched buckets in file order */
+    qsort(buckets, nb, sizeof(*buckets), uint32_cmp);
+    for (i = 0; i < nb; i++) {
+        if (i > 0 && buckets[i] == buckets[i - 1])
+            continue;
+
+        if (!htt_bucket(db, buckets[i]))
+            n_die("tndb: %p, htt_read failed\n", db);
+    }
+    free(buckets);
+
+    *ncands = 0;
+    for (i = 0; i < n; i++) {
+        const struct tndb_hent *he, *end;
+        uint32_t hv = khs[i].hv, hv_i = khs[i].hb & mask, fp = 0;
+
+        if (!maybe[i])          /* filtered out by TNDB_BLOOM */
+            continue;
+
+        he = &db->hents[db->hidx[hv_i]];
+        end = &db->hents[db->hidx[hv_i + 1]];
+
+        if (db->hdr.xflags & TNDB_FPRINT)
+            fp = TNDB_KH_FP(&khs[i], klens[i]);
+
+        for (he = hent_lower_bound(he, end - he, hv);
+             he < end && he->val == hv; he++) {
+
+            if (fp && db->hfps[he - db->hents] != fp)
+                continue;
+
+            if (*ncands == acands) {
+                acands = acands ? acands * 2 : n + 16;
+                cands = n_realloc(cands, acands * sizeof(*cands));
+            }
+
+            cands[*ncands].offs = he->offs;
+            cands[*ncands].i = i;
+            (*ncands)++;
+        }
+    }
+
+    free(khs);
+    free(maybe);
+    return cands;
+}
+
+/* TNDB_MPHF, at most one candidate per key */
+static
+struct mget_cand *mget_cands_mph(struct tndb *db, unsigned int n,
+                                 const char **keys, const unsigned int *klens,
+                                 unsigned int *ncands)
+{
+    struct mget_cand *cands;
+    unsigned int     i;
+
+    cands = n_malloc((n + 1) * sizeof(*cands));
+    *ncands = 0;
+
+    for (i = 0; i < n; i++) {
+        struct tndb_khash kh;
+        uint32_t          offs;
+
+        tndb_key_hash(&db->hdr, keys[i], klens[i], &kh);
+        if (!bloom_maybe(db, &kh))
+            continue;
+
+        if ((offs = mph_find(db, &kh, klens[i])) != 0) {
+            cands[*ncands].offs = offs;
+            cands[*ncands].i = i;
+            (*ncands)++;
+        }
+    }
+
+    return cands;
+}
+
+int tndb_mget(struct tndb *db, unsigned int n, const char **keys,
+              const unsigned int *klens, uint32_t *voffs,
+              unsigned int *vlens, void **vals)
+{
+    struct mget_cand *cands = NULL;
+    struct mget_win  win;
+    unsigned int     i, k, ncands = 0;
+    int              nfound = 0;
+
+    if (!verify_db(db))
+        return -1;
+
+    if (db->hdr.flags & TNDB_NOHASH)
+        n_die("tndb: method not allowed on file without hash table\n");
+
+    for (i = 0; i < n; i++) {
+        if (klens[i] > UINT8_MAX)
+            n_die("tndb: key too long (max is %d)\n", UINT8_MAX);
+
+        voffs[i] = 0;
+        vlens[i] = 0;
+        if (vals)
+            vals[i] = NULL;
+    }
+
+    if (db->hdr.xflags & TNDB_MPHF)
+        cands = mget_cands_mph(db, n, keys, klens, &ncands);
+    else
+        cands = mget_cands_htt(db, n, keys, klens, &ncands);
+
+    /* probe records in ascending file order */
+    qsort(cands, ncands, sizeof(*cands), mget_cand_cmp);
+
+    win.buf = db->map ? NULL : n_malloc(MGET_WINDOW); /* >= REC_PROBESIZE */
+    win.offs = 0;
+    win.len = 0;
+
+    /* the last one wins if key is duplicated, as in tndb_get_voff() */
+    for (k = 0; k < ncands; k++) {
+        const unsigned char *p;
+        unsigned int        avail, klen;
+        uint32_t            vlen, voff;
+        int                 rc;
+
+        i = cands[k].i;
+        klen = klens[i];
+        if ((p = mget_win_get(db, &win, cands, k, ncands, klens, &avail)) == NULL)
+            goto l_err;
+
+        if ((rc = rec_match(p, avail, keys[i], klen, &vlen)) == 0)
+            continue;
+
+        if (rc < 0)
+            goto l_err;
+
+        voff = cands[k].offs + REC_HDRSIZE(klen);
+        if (voffs[i] == 0)
+            nfound++;
+
+        if (vals) {
+            unsigned char *val = n_malloc(vlen + 1); /* extra byte for \0 */
+
+            if (avail >= REC_HDRSIZE(klen) + vlen) {
+                if (db->map && !mrkl_check(db, voff, vlen)) {
+                    free(val);
+                    goto l_err;
+                }
+                memcpy(val, p + REC_HDRSIZE(klen), vlen);
+
+            } else if (db_read_offs(db, val, vlen, voff) != (int)vlen) {
+                free(val);
+                goto l_err;
+            }
+
+            free(vals[i]);
+            vals[i] = val;
+        }
+
+        voffs[i] = voff;
+        vlens[i] = vlen;
+    }
+
+    free(win.buf);
+    free(cands);
+    return nfound;
+
+ l_err:
+    if (vals) {
+        for (i = 0; i < n; i++)
+            n_cfree(&vals[i]);
+    }
+
+    free(win.buf);
+    free(cands);
+    return -1;
+}
+
 tn_array *tndb_keys(struct tndb *db)
 {
     struct tndb_it  it;
@@ -616,67 +2078,250 @@ int tndb_it_start(struct tndb *db, struct tndb_it *it)
     return 1;
 }
 
+#define IT_READAHEAD    (256 * 1024)
+
+/* db's own window is shared by its iterators, others are private */
+static inline void win_lock(const struct tndb *db, const struct tndb_win *win)
+{
+    if (win == &db->itwin)
+        tndb_lock(db);
+}
+
+static inline void win_unlock(const struct tndb *db, const struct tndb_win *win)
+{
+    if (win == &db->itwin)
+        tndb_unlock(db);
+}
 
 /*
-  key size must be at least 256 + 1 bytes (maximum tndb key length)
-  if key is NULL then keys are not retrieved
- */
-int tndb_it_get_voff(struct tndb_it *it, void *key, unsigned int *klen,
-                     uint32_t *voff, unsigned int *vlen)
+  Returns pointer to size bytes at offs in db's mapping or in read-ahead
+  window, which is refilled with IT_READAHEAD bytes (or more, for a bigger
+  record) at once. Caller holds win_lock().
+*/
+static
+const unsigned char *it_window(const struct tndb *db, struct tndb_win *win,
+                               uint32_t offs, unsigned int size)
+{
+    unsigned int keep = 0;
+    int          n;
+
+    if (db->map)
+        return map_ptr(db, offs, size);
+
+    if (win->len > 0 && offs >= win->offs && offs - win->offs < win->len) {
+        if (size <= win->len - (offs - win->offs))
+            return win->buf + (offs - win->offs);
+
+        /* record crosses window's end, keep its head instead of seeking
+           back, which is expensive on compressed streams */
+        keep = win->len - (offs - win->offs);
+    }
+
+    if (win->size < size || win->buf == NULL) {
+        win->size = size > IT_READAHEAD ? size : IT_READAHEAD;
+        win->buf = n_realloc(win->buf, win->size);
+    }
+
+    if (keep > 0)
+        memmove(win->buf, win->buf + (offs - win->offs), keep);
+
+    win->len = 0;
+    n = db_read_offs(db, win->buf + keep, win->size - keep, offs + keep);
+    if (n < 0 || keep + n < size)
+        return NULL;
+
+    win->offs = offs;
+    win->len = keep + n;
+
+    return win->buf;
+}
+
+/*
+  Points *rec to the next record, the whole one if withval is set,
+  headers only otherwise.
+  Returns 1 if record is retrieved, 0 at the end and -1 on error.
+*/
+static int it_next(struct tndb_it *it, struct tndb_win *win, int withval,
+                   const unsigned char **rec, uint8_t *klen, uint32_t *vlen)
+{
+    struct tndb         *db = it->_db;
+    const unsigned char *p;
+    uint32_t            len;
+
+    n_assert(it->_get_flag == 0);
+
+    if (it->_nrec == db->hdr.nrec)
+        return 0;
+
+    if ((p = it_window(db, win, it->_off, sizeof(uint8_t))) == NULL)
+        return -1;
+
+    *klen = p[0];
+    if ((p = it_window(db, win, it->_off, REC_HDRSIZE(*klen))) == NULL)
+        return -1;
+
+    memcpy(&len, p + sizeof(uint8_t) + *klen, sizeof(len));
+    *vlen = n_ntoh32(len);
+
+    if (*vlen > UINT32_MAX - it->_off - REC_HDRSIZE(*klen))
+        return -1;
+
+    if (withval &&
+        (p = it_window(db, win, it->_off, REC_HDRSIZE(*klen) + *vlen)) == NULL)
+        return -1;
+
+    DBGF("get %d of %d at %u\n", it->_nrec, db->hdr.nrec, it->_off);
+    *rec = p;
+    it->_off += REC_HDRSIZE(*klen) + *vlen;
+    it->_nrec++;
+
+    return 1;
+}
+
+/* TNDB_ORDIDX: reads offsets of n records from i-th one */
+static int ord_offs(struct tndb *db, uint32_t i, uint32_t n, uint32_t *offs)
+{
+    uint32_t     sect, j;
+    unsigned int size = n * sizeof(*offs);
+
+    n_assert(i < db->hdr.nrec && n <= db->hdr.nrec - i);
+
+    if ((sect = tail_sect_offs(db, TNDB_ORDIDX)) == 0)
+        goto l_einval;
+
+    if (db_pread(db, offs, size, sect + i * sizeof(*offs)) != (int)size)
+        return 0;
+
+    for (j=0; j < n; j++) {
+        offs[j] = n_ntoh32(offs[j]);
+
+        if (offs[j] < db->hdr.doffs)
+            goto l_einval;
+    }
+
+    return 1;
+
+ l_einval:
+    errno = EINVAL;
+    return 0;
+}
+
+int tndb_it_start_nth(struct tndb *db, struct tndb_it *it, uint32_t i)
+{
+    uint32_t offs;
+
+    if (!tndb_it_start(db, it))
+        return 0;
+
+    if (i == 0)
+        return 1;
+
+    if ((db->hdr.xflags & TNDB_ORDIDX) == 0 || i >= db->hdr.nrec)
+        return 0;
+
+    if (!ord_offs(db, i, 1, &offs))
+        return 0;
+
+    it->_off = offs;
+    it->_nrec = i;
+    return 1;
+}
+
+int tndb_get_nth(struct tndb *db, uint32_t i, void *key, unsigned int *klen,
+                 uint32_t *voff, unsigned int *vlen)
 {
-    uint8_t db_klen = 0;
-    uint32_t vlen32 = 0;
-    tn_stream *st;
+    unsigned char       buf[REC_HDRSIZE(TNDB_KEY_MAX)];
+    const unsigned char *k;
+    uint32_t            offs, len;
+    uint8_t             db_klen;
 
-    n_assert(it->_get_flag == 0);
+    n_assert(db->rtflags & TNDB_R_MODE_R);
 
-    if (key)
-        *klen = 0;
+    if (!verify_db(db))
+        return -1;
 
-    if (it->_nrec == it->_db->hdr.nrec)
+    if ((db->hdr.xflags & TNDB_ORDIDX) == 0 || i >= db->hdr.nrec)
         return 0;
 
-    st = it->_db->st;
+    if (!ord_offs(db, i, 1, &offs))
+        return -1;
 
-    if (nn_stream_read_offs(st, &db_klen, 1, it->_off) != 1)
-        return 0;
+    if ((k = rec_head(db, offs, buf, &db_klen, &len)) == NULL)
+        return -1;
 
     if (klen)
         *klen = db_klen;
 
-    DBGF("get %d of %d\n", it->_nrec, it->_db->hdr.nrec);
     if (key) {
-        if (n_stream_read(st, key, db_klen) != db_klen)
-            return 0;
-
+        memcpy(key, k, db_klen);
         ((unsigned char *)key)[db_klen] = '\0';
-        DBGF("key[%d] %s(%d)\n", it->_off, key, db_klen);
     }
 
-    it->_off += db_klen + 1;
-    *voff = it->_off + sizeof(uint32_t);
+    *voff = offs + REC_HDRSIZE(db_klen);
+    *vlen = len;
+    return 1;
+}
+
+/* tndb_it_get_voff() with record header read through win */
+static int it_get_voff(struct tndb_it *it, struct tndb_win *win,
+                       void *key, unsigned int *klen,
+                       uint32_t *voff, unsigned int *vlen)
+{
+    const unsigned char *p = NULL;
+    struct tndb         *db = it->_db;
+    uint32_t            offs = it->_off, vlen32 = 0;
+    uint8_t             db_klen = 0;
+    int                 rc;
+
+    if (key)
+        *klen = 0;
 
-    if (!nn_stream_read_uint32_offs(st, &vlen32, it->_off))
+    win_lock(db, win);
+    if ((rc = it_next(it, win, 0, &p, &db_klen, &vlen32)) > 0 && key) {
+        memcpy(key, p + sizeof(uint8_t), db_klen);
+        ((unsigned char *)key)[db_klen] = '\0';
+        DBGF("key[%d] %s(%d)\n", offs, key, db_klen);
+    }
+    win_unlock(db, win);
+
+    if (rc <= 0)
         return 0;
 
-    DBGF("vlen of key %s = %d\n", key ? key : "(null)", vlen32);
+    if (klen)
+        *klen = db_klen;
 
+    *voff = offs + REC_HDRSIZE(db_klen);
     *vlen = vlen32;
-    it->_off += *vlen + sizeof(uint32_t);
-    it->_nrec++;
-    //DBGF("val[%d] (%d)\n", it->_offs, *vlen);
     return *vlen;
 }
 
+/* reads value of the current record, through the window if it fits */
+static int it_read_val(struct tndb *db, struct tndb_win *win,
+                       void *buf, unsigned int size, uint32_t offs)
+{
+    const unsigned char *p;
 
-int tndb_it_get(struct tndb_it *it, void *key, unsigned int *klen,
-                void *val, unsigned int *avlen)
+    if (size > IT_READAHEAD)
+        return db_read_offs(db, buf, size, offs);
+
+    win_lock(db, win);
+    if ((p = it_window(db, win, offs, size)) != NULL)
+        memcpy(buf, p, size);
+    win_unlock(db, win);
+
+    return p ? (int)size : -1;
+}
+
+/* tndb_it_get() with value read through win */
+static int it_get(struct tndb_it *it, struct tndb_win *win,
+                  void *key, unsigned int *klen,
+                  void *val, unsigned int *avlen)
 {
     uint32_t     voff;
     unsigned int vlen;
     int          rc = 0;
 
-    if (!tndb_it_get_voff(it, key, klen, &voff, &vlen))
+    if (!it_get_voff(it, win, key, klen, &voff, &vlen))
         return 0;
 
     if ((vlen + 1) > *avlen) {
@@ -685,13 +2330,63 @@ int tndb_it_get(struct tndb_it *it, void *key, unsigned int *klen,
     }
 
     *avlen = vlen;
-    rc = (n_stream_read(it->_db->st, val, vlen) == (int)vlen);
+    rc = (it_read_val(it->_db, win, val, vlen, voff) == (int)vlen);
     if (rc)
         ((char*)val)[vlen] = '\0';
 
     return rc;
 }
 
+/* tndb_it_get_ref() with record read through win */
+static int it_get_ref(struct tndb_it *it, struct tndb_win *win,
+                      const void **key, unsigned int *klen,
+                      const void **val, unsigned int *vlen)
+{
+    const unsigned char *p = NULL;
+    uint32_t            vlen32 = 0;
+    uint8_t             db_klen = 0;
+    int                 rc;
+
+    if ((rc = it_next(it, win, 1, &p, &db_klen, &vlen32)) <= 0)
+        return rc;
+
+    if (key)
+        *key = p + sizeof(uint8_t);
+
+    if (klen)
+        *klen = db_klen;
+
+    *val = p + REC_HDRSIZE(db_klen);
+    *vlen = vlen32;
+    return 1;
+}
+
+/*
+  key size must be at least 256 + 1 bytes (maximum tndb key length)
+  if key is NULL then keys are not retrieved
+ */
+int tndb_it_get_voff(struct tndb_it *it, void *key, unsigned int *klen,
+                     uint32_t *voff, unsigned int *vlen)
+{
+    return it_get_voff(it, &it->_db->itwin, key, klen, voff, vlen);
+}
+
+int tndb_it_get_ref(struct tndb_it *it, const void **key, unsigned int *klen,
+                    const void **val, unsigned int *vlen)
+{
+    /* views of the shared window would be overwritten by other threads */
+    if (it->_db->lock && it->_db->map == NULL)
+        return -1;
+
+    return it_get_ref(it, &it->_db->itwin, key, klen, val, vlen);
+}
+
+int tndb_it_get(struct tndb_it *it, void *key, unsigned int *klen,
+                void *val, unsigned int *avlen)
+{
+    return it_get(it, &it->_db->itwin, key, klen, val, avlen);
+}
+
 int tndb_it_rget(struct tndb_it *it, void *key, unsigned int *klen,
                  void **val, unsigned int *avlen)
 {
@@ -710,13 +2405,225 @@ int tndb_it_rget(struct tndb_it *it, void *key, unsigned int *klen,
     }
 
     *avlen = vlen;
-    rc = (n_stream_read(it->_db->st, *val, vlen) == (int)vlen);
+    rc = (it_read_val(it->_db, &it->_db->itwin, *val, vlen, voff) ==
+          (int)vlen);
     if (rc)
         ((char*)*val)[vlen] = '\0';
 
     return rc;
 }
 
+static int keyset_cmp(const void *a, const void *b)
+{
+    const struct tndb_key *k1 = a, *k2 = b;
+
+    return tndb_key_cmp(k1->key, k1->klen, k2->key, k2->klen);
+}
+
+struct tndb_keyset *tndb_keyset(struct tndb *db, unsigned flags)
+{
+    struct tndb_keyset  *ks;
+    struct tndb_it      it;
+    struct tndb_win     win;
+    const unsigned char *p;
+    uint32_t            i, vlen;
+    uint8_t             klen;
+    int                 rc = 0;
+
+    if (!tndb_it_start(db, &it))
+        return NULL;
+
+    ks = n_calloc(1, sizeof(*ks));
+    ks->keys = n_malloc((db->hdr.nrec + 1) * sizeof(*ks->keys));
+    ks->_na = n_alloc_new(64, TN_ALLOC_OBSTACK);
+
+    memset(&win, 0, sizeof(win));
+    for (i=0; i < db->hdr.nrec; i++) {
+        char *key;
+
+        if ((rc = it_next(&it, &win, 0, &p, &klen, &vlen)) <= 0)
+            break;
+
+        key = ks->_na->na_malloc(ks->_na, klen + 1);
+        memcpy(key, p + sizeof(uint8_t), klen);
+        key[klen] = '\0';
+
+        ks->keys[i].key = key;
+        ks->keys[i].klen = klen;
+    }
+    free(win.buf);
+
+    ks->nkeys = i;
+    if (i != db->hdr.nrec) {
+        tndb_keyset_free(ks);
+        return NULL;
+    }
+
+    if (flags & TNDB_KEYSET_SORTED)
+        qsort(ks->keys, ks->nkeys, sizeof(*ks->keys), keyset_cmp);
+
+    return ks;
+}
+
+void tndb_keyset_free(struct tndb_keyset *ks)
+{
+    n_alloc_free(ks->_na);
+    free(ks->keys);
+    free(ks);
+}
+
+/* iterator over consecutive records of db with its own window */
+struct tndb_part {
+    struct tndb_it  it;
+    struct tndb_win win;
+};
+
+/* returns offsets of all records, in no particular order */
+static uint32_t *rec_offsets(struct tndb *db)
+{
+    struct tndb_it      it;
+    struct tndb_win     win;
+    const unsigned char *p;
+    uint32_t            *offs, i, vlen;
+    uint8_t             klen;
+
+    offs = n_malloc((db->hdr.nrec + 1) * sizeof(*offs));
+
+    if (db->hdr.xflags & TNDB_ORDIDX) {
+        if (!ord_offs(db, 0, db->hdr.nrec, offs))
+            goto l_err;
+
+        return offs;
+    }
+
+    /* hash table has entry of every record */
+    if ((db->hdr.flags & TNDB_NOHASH) == 0 &&
+        (db->hdr.xflags & TNDB_MPHF) == 0) {
+        for (i=0; i < db->hdr.htsize; i++) {
+            if (!htt_bucket(db, i))
+                goto l_err;
+        }
+
+        for (i=0; i < db->hdr.nrec; i++)
+            offs[i] = db->hents[i].offs;
+
+        return offs;
+    }
+
+    /* the hard way otherwise */
+    if (!tndb_it_start(db, &it))
+        goto l_err;
+
+    memset(&win, 0, sizeof(win));
+    for (i=0; i < db->hdr.nrec; i++) {
+        offs[i] = it._off;
+        if (it_next(&it, &win, 0, &p, &klen, &vlen) <= 0)
+            break;
+    }
+    free(win.buf);
+
+    if (i == db->hdr.nrec)
+        return offs;
+
+ l_err:
+    free(offs);
+    return NULL;
+}
+
+int tndb_split(struct tndb *db, unsigned int n, struct tndb_part **parts)
+{
+    uint32_t *offs, *starts, *counts, maxoffs, i;
+    uint64_t span;
+    int      nparts = 0;
+
+    n_assert(db->rtflags & TNDB_R_MODE_R);
+
+    if (!verify_db(db))
+        return -1;
+
+    if (n == 0 || db->hdr.nrec == 0)
+        return 0;
+
+    if ((offs = rec_offsets(db)) == NULL)
+        return -1;
+
+    maxoffs = db->hdr.doffs;
+    for (i=0; i < db->hdr.nrec; i++) {
+        if (offs[i] < db->hdr.doffs) {
+            free(offs);
+            errno = EINVAL;
+            return -1;
+        }
+
+        if (offs[i] > maxoffs)
+            maxoffs = offs[i];
+    }
+
+    /* part j gets records starting in j-th of n equal ranges of data */
+    span = (uint64_t)maxoffs - db->hdr.doffs + 1;
+    starts = n_malloc(n * sizeof(*starts));
+    counts = n_calloc(n, sizeof(*counts));
+
+    for (i=0; i < n; i++)
+        starts[i] = UINT32_MAX;
+
+    for (i=0; i < db->hdr.nrec; i++) {
+        uint32_t j = (uint64_t)(offs[i] - db->hdr.doffs) * n / span;
+
+        counts[j]++;
+        if (offs[i] < starts[j])
+            starts[j] = offs[i];
+    }
+
+    for (i=0; i < n; i++) {
+        struct tndb_part *part;
+
+        if (counts[i] == 0)
+            continue;
+
+        part = n_calloc(1, sizeof(*part));
+        part->it._db = db;
+        part->it.st = db->st;
+        part->it._off = starts[i];
+        /* it stops once nrec records are counted */
+        part->it._nrec = db->hdr.nrec - counts[i];
+        part->it._get_flag = 0;
+
+        DBGF("part %d at %u, %u records\n", nparts, starts[i], counts[i]);
+        parts[nparts++] = part;
+    }
+
+    free(offs);
+    free(starts);
+    free(counts);
+
+    return nparts;
+}
+
+int tndb_part_get_voff(struct tndb_part *part, void *key, unsigned int *klen,
+                       uint32_t *voff, unsigned int *vlen)
+{
+    return it_get_voff(&part->it, &part->win, key, klen, voff, vlen);
+}
+
+int tndb_part_get(struct tndb_part *part, void *key, unsigned int *klen,
+                  void *val, unsigned int *vlen)
+{
+    return it_get(&part->it, &part->win, key, klen, val, vlen);
+}
+
+int tndb_part_get_ref(struct tndb_part *part, const void **key,
+                      unsigned int *klen, const void **val, unsigned int *vlen)
+{
+    return it_get_ref(&part->it, &part->win, key, klen, val, vlen);
+}
+
+void tndb_part_free(struct tndb_part *part)
+{
+    free(part->win.buf);
+    free(part);
+}
+
 int tndb_it_get_begin(struct tndb_it *it, void *key, unsigned int *klen,
                       unsigned int *avlen)
 {
@@ -725,9 +2632,16 @@ int tndb_it_get_begin(struct tndb_it *it, void *key, unsigned int *klen,
 
     n_assert(it->_get_flag == 0);
 
+    if (it->_db->hdr.xflags & TNDB_BLOCKZ)
+        n_die("tndb: method not allowed on block compressed file\n");
+
     if (!tndb_it_get_voff(it, key, klen, &voff, &vlen))
         return 0;
 
+    /* value is read by caller, directly from the stream */
+    if (it->_db->mrkl_ok && !mrkl_check(it->_db, voff, vlen))
+        return 0;
+
     n_stream_seek(it->_db->st, voff, SEEK_SET);
     it->_get_flag = 1;
 
@@ -756,12 +2670,196 @@ int tndb_it_get_end(struct tndb_it *it)
     return 1;
 }
 
-int tndb_read(struct tndb *db, long offs, void *buf, unsigned int size)
+static int kidx_read(struct tndb *db)
+{
+    uint32_t i, size, offs;
+
+    size = db->hdr.kidx_nkeys * sizeof(uint32_t);
+    if ((offs = tail_sect_offs(db, TNDB_KEYIDX)) == 0)
+        goto l_einval;
+
+    db->kidx = n_malloc(size + sizeof(uint32_t));
+    if (db_pread(db, db->kidx, size, offs) != (int)size)
+        return 0;
+
+    for (i=0; i < db->hdr.kidx_nkeys; i++) {
+        db->kidx[i] = n_ntoh32(db->kidx[i]);
+
+        if (db->kidx[i] < db->hdr.doffs)
+            goto l_einval;
+    }
+
+    return 1;
+
+ l_einval:
+    errno = EINVAL;
+    return 0;
+}
+
+static int kidx_load(struct tndb *db)
+{
+    int rc = 1;
+
+    if (tndb_rtflags(db) & TNDB_R_KIDX_LOADED)
+        return 1;
+
+    tndb_lock(db);
+    if ((db->rtflags & TNDB_R_KIDX_LOADED) == 0) {
+        if ((rc = kidx_read(db)))
+            tndb_rtflags_set(db, TNDB_R_KIDX_LOADED);
+    }
+    tndb_unlock(db);
+
+    return rc;
+}
+
+/*
+  Returns position of the first key not less than key or, if upper is
+  set, of the first one greater than it when truncated to klen, i.e. the
+  end of keys prefixed by key. Returns -1 on error.
+*/
+static int64_t kidx_bound(struct tndb *db, const void *key, unsigned int klen,
+                          int upper)
+{
+    unsigned char buf[REC_HDRSIZE(TNDB_KEY_MAX)];
+    uint32_t      lo = 0, hi = db->hdr.kidx_nkeys;
+
+    while (lo < hi) {
+        uint32_t            mid = lo + (hi - lo) / 2, vlen;
+        const unsigned char *k;
+        uint8_t             rklen;
+        int                 cmp;
+
+        if ((k = rec_head(db, db->kidx[mid], buf, &rklen, &vlen)) == NULL)
+            return -1;
+
+        if (upper && rklen > klen)
+            rklen = klen;
+
+        cmp = tndb_key_cmp(k, rklen, key, klen);
+        if (upper ? cmp <= 0 : cmp < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+static int kit_init(struct tndb *db, struct tndb_kit *it)
+{
+    n_assert(db->rtflags & TNDB_R_MODE_R);
+
+    if (!verify_db(db))
+        return 0;
+
+    if ((db->hdr.xflags & TNDB_KEYIDX) == 0)
+        return 0;
+
+    if (!kidx_load(db))
+        return 0;
+
+    it->_db = db;
+    it->_pos = 0;
+    it->_end = db->hdr.kidx_nkeys;
+    return 1;
+}
+
+int tndb_kit_start(struct tndb *db, struct tndb_kit *it)
+{
+    return kit_init(db, it);
+}
+
+int tndb_kit_seek(struct tndb *db, struct tndb_kit *it,
+                  const void *key, unsigned int klen)
+{
+    int64_t pos;
+
+    if (!kit_init(db, it))
+        return 0;
+
+    if ((pos = kidx_bound(db, key, klen, 0)) < 0)
+        return 0;
+
+    it->_pos = pos;
+    return 1;
+}
+
+int tndb_kit_prefix(struct tndb *db, struct tndb_kit *it,
+                    const void *prefix, unsigned int plen)
+{
+    int64_t pos, end;
+
+    if (!kit_init(db, it))
+        return 0;
+
+    if ((pos = kidx_bound(db, prefix, plen, 0)) < 0)
+        return 0;
+
+    if ((end = kidx_bound(db, prefix, plen, 1)) < 0)
+        return 0;
+
+    it->_pos = pos;
+    it->_end = end;
+    return 1;
+}
+
+int tndb_kit_get_voff(struct tndb_kit *it, void *key, unsigned int *klen,
+                      uint32_t *voff, unsigned int *vlen)
 {
-    if (n_stream_seek(db->st, offs, SEEK_SET) == -1)
+    unsigned char       buf[REC_HDRSIZE(TNDB_KEY_MAX)];
+    const unsigned char *k;
+    uint32_t            offs, len;
+    uint8_t             db_klen;
+
+    if (it->_pos >= it->_end)
+        return 0;
+
+    offs = it->_db->kidx[it->_pos];
+    if ((k = rec_head(it->_db, offs, buf, &db_klen, &len)) == NULL)
         return -1;
 
-    return n_stream_read(db->st, buf, size);
+    if (klen)
+        *klen = db_klen;
+
+    if (key) {
+        memcpy(key, k, db_klen);
+        ((unsigned char *)key)[db_klen] = '\0';
+    }
+
+    *voff = offs + REC_HDRSIZE(db_klen);
+    *vlen = len;
+    it->_pos++;
+
+    return 1;
+}
+
+int tndb_kit_get(struct tndb_kit *it, void *key, unsigned int *klen,
+                 void *val, unsigned int *avlen)
+{
+    uint32_t     voff;
+    unsigned int vlen;
+    int          rc = 0;
+
+    if (tndb_kit_get_voff(it, key, klen, &voff, &vlen) <= 0)
+        return 0;
+
+    if ((vlen + 1) > *avlen) {
+        n_die("tndb: not enough space for data (%d > %d)\n", vlen, *avlen);
+        return 0;
+    }
+
+    *avlen = vlen;
+    rc = (db_read_offs(it->_db, val, vlen, voff) == (int)vlen);
+    if (rc)
+        ((char*)val)[vlen] = '\0';
+
+    return rc;
+}
+
+int tndb_read(struct tndb *db, long offs, void *buf, unsigned int size)
+{
+    return db_read_offs(db, buf, size, offs);
 }
 
 uint32_t tndb_size(const struct tndb *db) {
@@ -300,6 +300,54 @@ START_TEST(test_keys_api)
 }
 END_TEST
 
+START_TEST(test_keyset)
+{
+    struct tndb *db;
+    struct tndb_keyset *ks;
+    char key[32];
+    int i;
+    int nrec = 50;
+    char *path = NTEST_TMPPATH("tndb_keyset.db");
+
+    unlink(path);
+
+    db = tndb_creat(path, -1, 0);
+    expect_notnull(db);
+
+    /* reversed, with empty values */
+    for (i = nrec - 1; i >= 0; i--) {
+        snprintf(key, sizeof(key), "key%.3d", i);
+        expect_int(tndb_put(db, key, strlen(key), "", 0), 1);
+    }
+    expect_int(tndb_close(db), 1);
+
+    db = tndb_open(path);
+    expect_notnull(db);
+
+    ks = tndb_keyset(db, 0);
+    expect_notnull(ks);
+    expect_int(ks->nkeys, nrec);
+    for (i = 0; i < nrec; i++) {
+        snprintf(key, sizeof(key), "key%.3d", nrec - 1 - i);
+        expect_str(ks->keys[i].key, key);
+        expect_int(ks->keys[i].klen, strlen(key));
+    }
+    tndb_keyset_free(ks);
+
+    ks = tndb_keyset(db, TNDB_KEYSET_SORTED);
+    expect_notnull(ks);
+    expect_int(ks->nkeys, nrec);
+    for (i = 0; i < nrec; i++) {
+        snprintf(key, sizeof(key), "key%.3d", i);
+        expect_str(ks->keys[i].key, key);
+    }
+    tndb_keyset_free(ks);
+
+    expect_int(tndb_close(db), 1);
+    unlink(path);
+}
+END_TEST
+
 NTEST_RUNNER("tndb-basic",
              test_creat_open_close,
              test_empty_database,
@@ -309,5 +357,6 @@ NTEST_RUNNER("tndb-basic",
              test_corrupted_database,
              test_refcount,
              test_path_and_stream,
-             test_keys_api
+             test_keys_api,
+             test_keyset
 );
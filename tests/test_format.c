@@ -0,0 +1,982 @@
+#include <config.h>
+
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include <trurl/narray.h>
+#include <trurl/nmalloc.h>
+#include <trurl/n_snprintf.h>
+#include <trurl/n_check.h>
+
+#include "tndb.h"
+
+#define NKEYS 2000
+
+static void read_magic(const char *path, char *magic)
+{
+    FILE *f = fopen(path, "rb");
+
+    expect_notnull(f);
+    expect_int(fread(magic, 1, 8, f), 8);
+    magic[8] = '\0';
+    fclose(f);
+}
+
+static void creat_db(const char *path, unsigned flags)
+{
+    struct tndb *db;
+    char key[64], val[64];
+    int i;
+
+    unlink(path);
+    db = tndb_creat(path, -1, flags);
+    expect_notnull(db);
+
+    for (i = 0; i < NKEYS; i++) {
+        int klen = n_snprintf(key, sizeof(key), "key%d", i);
+        int vlen = n_snprintf(val, sizeof(val), "val%d", i);
+        expect_int(tndb_put(db, key, klen, val, vlen), 1);
+    }
+
+    expect_int(tndb_close(db), 1);
+}
+
+static void check_db(const char *path)
+{
+    struct tndb *db;
+    char key[64], val[64], buf[64];
+    int i, n;
+
+    db = tndb_open(path);
+    expect_notnull(db);
+    expect_int(tndb_size(db), NKEYS);
+    expect_int(tndb_verify(db), 1);
+
+    for (i = 0; i < NKEYS; i++) {
+        int klen = n_snprintf(key, sizeof(key), "key%d", i);
+        int vlen = n_snprintf(val, sizeof(val), "val%d", i);
+
+        n = tndb_get(db, key, klen, buf, sizeof(buf));
+        expect_int(n, vlen);
+        expect_int(memcmp(buf, val, vlen), 0);
+    }
+
+    for (i = 0; i < NKEYS; i++) {
+        int klen = n_snprintf(key, sizeof(key), "nokey%d", i);
+        expect_int(tndb_get(db, key, klen, buf, sizeof(buf)), 0);
+    }
+
+    expect_int(tndb_close(db), 1);
+}
+
+START_TEST(test_default_format)
+{
+    char *path = NTEST_TMPPATH("tndb_fmt10.db");
+    char magic[9];
+
+    creat_db(path, TNDB_SIGNED);
+    read_magic(path, magic);
+    expect_str(magic, "tndb1.0\n");
+
+    check_db(path);
+    unlink(path);
+}
+END_TEST
+
+START_TEST(test_fprint)
+{
+    char *path = NTEST_TMPPATH("tndb_fprint.db");
+    const char *keys[] = { "key1", "nokey", "key1999", "key1" };
+    unsigned int klens[4], vlens[4];
+    uint32_t voffs[4];
+    struct tndb *db;
+    char magic[9];
+    int i;
+
+    creat_db(path, TNDB_SIGNED | TNDB_FPRINT);
+    read_magic(path, magic);
+    expect_str(magic, "tndb1.1\n");
+
+    check_db(path);
+
+    db = tndb_open(path);
+    expect_notnull(db);
+
+    for (i = 0; i < 4; i++)
+        klens[i] = strlen(keys[i]);
+
+    expect_int(tndb_mget(db, 4, keys, klens, voffs, vlens, NULL), 3);
+    expect_int(vlens[0], 4);
+    expect_int(vlens[1], 0);
+    expect_int(vlens[2], 7);
+    expect_int(voffs[3], voffs[0]);
+
+    expect_int(tndb_close(db), 1);
+    unlink(path);
+}
+END_TEST
+
+START_TEST(test_blockz)
+{
+    char *path = NTEST_TMPPATH("tndb_blockz.db");
+    char *gzpath = NTEST_TMPPATH("tndb_blockz.db.gz");
+    char key[64], val[512], buf[512];
+    struct tndb *db;
+    struct tndb_it it;
+    struct stat st;
+    unsigned int klen, vlen;
+    int i, n, vsize = 0;
+
+    expect_null(tndb_creat(gzpath, -1, TNDB_BLOCKZ));
+
+    unlink(path);
+    db = tndb_creat(path, -1, TNDB_SIGNED | TNDB_BLOCKZ);
+    expect_notnull(db);
+
+    for (i = 0; i < NKEYS; i++) {
+        klen = n_snprintf(key, sizeof(key), "key%d", i);
+        vlen = n_snprintf(val, sizeof(val), "%0*d", 100 + i % 300, i);
+        expect_int(tndb_put(db, key, klen, val, vlen), 1);
+        vsize += vlen;
+    }
+    expect_int(tndb_close(db), 1);
+
+    /* values are well compressible */
+    expect_int(stat(path, &st), 0);
+    expect_int(st.st_size < vsize / 4, 1);
+
+    db = tndb_open_ex(path, TNDB_O_MMAP);
+    expect_notnull(db);
+    expect_int(tndb_verify(db), 1);
+
+    for (i = NKEYS - 1; i >= 0; i--) {
+        klen = n_snprintf(key, sizeof(key), "key%d", i);
+        vlen = n_snprintf(val, sizeof(val), "%0*d", 100 + i % 300, i);
+
+        n = tndb_get(db, key, klen, buf, sizeof(buf));
+        expect_int(n, vlen);
+        expect_int(memcmp(buf, val, vlen), 0);
+    }
+
+    expect_int(tndb_get(db, "nokey", 5, buf, sizeof(buf)), 0);
+
+    expect_int(tndb_it_start(db, &it), 1);
+    for (i = 0; i < NKEYS; i++) {
+        vlen = sizeof(buf);
+        expect_int(tndb_it_get(&it, key, &klen, buf, &vlen), 1);
+        expect_int(vlen, 100 + i % 300);
+        expect_int(atoi(buf), i);
+    }
+
+    expect_int(tndb_close(db), 1);
+    unlink(path);
+}
+END_TEST
+
+START_TEST(test_mphf)
+{
+    char *path = NTEST_TMPPATH("tndb_mphf.db");
+    const char *keys[] = { "key7", "nokey", "dup", "key1999" };
+    unsigned int klens[4], vlens[4];
+    uint32_t voffs[4];
+    struct tndb *db;
+    char buf[64];
+    struct stat st1, st2;
+    int i;
+
+    creat_db(path, TNDB_SIGNED);
+    expect_int(stat(path, &st1), 0);
+
+    creat_db(path, TNDB_SIGNED | TNDB_MPHF);
+    expect_int(stat(path, &st2), 0);
+    expect_int(st2.st_size < st1.st_size, 1); /* smaller index */
+    check_db(path);
+
+    creat_db(path, TNDB_SIGNED | TNDB_MPHF | TNDB_FPRINT);
+    check_db(path);
+
+    /* the last duplicate wins */
+    unlink(path);
+    db = tndb_creat(path, -1, TNDB_MPHF);
+    expect_notnull(db);
+    expect_int(tndb_put(db, "dup", 3, "v1", 2), 1);
+    expect_int(tndb_put(db, "key7", 4, "v7", 2), 1);
+    expect_int(tndb_put(db, "dup", 3, "v2", 2), 1);
+    expect_int(tndb_put(db, "key1999", 7, "v1999", 5), 1);
+    expect_int(tndb_close(db), 1);
+
+    db = tndb_open(path);
+    expect_notnull(db);
+    expect_int(tndb_get_str(db, "dup", (unsigned char*)buf, sizeof(buf)), 2);
+    expect_str(buf, "v2");
+
+    for (i = 0; i < 4; i++)
+        klens[i] = strlen(keys[i]);
+
+    expect_int(tndb_mget(db, 4, keys, klens, voffs, vlens, NULL), 3);
+    expect_int(vlens[0], 2);
+    expect_int(vlens[1], 0);
+    expect_int(vlens[3], 5);
+    expect_int(tndb_read(db, voffs[2], buf, 2), 2);
+    expect_int(memcmp(buf, "v2", 2), 0);
+    expect_int(tndb_close(db), 1);
+
+    /* empty one */
+    unlink(path);
+    db = tndb_creat(path, -1, TNDB_MPHF | TNDB_SIGNED);
+    expect_notnull(db);
+    expect_int(tndb_close(db), 1);
+
+    db = tndb_open(path);
+    expect_notnull(db);
+    expect_int(tndb_get(db, "dup", 3, buf, sizeof(buf)), 0);
+    expect_int(tndb_close(db), 1);
+
+    /* distinct keys of the same tndb_hash() and tndb_fprint() */
+    {
+        const char *k1 = "ad2ad2aa2ac6aa2acpaa6ad2ad2acpac6acpacpaa6ad2ad2aa2ac6acpacpagpafp";
+        const char *k2 = "ad2ad2aa2ac6aa2acpaa6ad2afpaa2aepaa2acpaa6afpad2aa2aepaa2acpagpad2";
+
+        unlink(path);
+        db = tndb_creat(path, -1, TNDB_MPHF | TNDB_SIGNED);
+        expect_notnull(db);
+        expect_int(tndb_put(db, k1, strlen(k1), "v1", 2), 1);
+        expect_int(tndb_put(db, "key7", 4, "v7", 2), 1);
+        expect_int(tndb_put(db, k2, strlen(k2), "v2", 2), 1);
+        expect_int(tndb_close(db), 1);
+
+        db = tndb_open(path);
+        expect_notnull(db);
+        expect_int(tndb_verify(db), 1);
+        expect_int(tndb_get_str(db, k1, (unsigned char*)buf, sizeof(buf)), 2);
+        expect_str(buf, "v1");
+        expect_int(tndb_get_str(db, k2, (unsigned char*)buf, sizeof(buf)), 2);
+        expect_str(buf, "v2");
+        expect_int(tndb_get_str(db, "key7", (unsigned char*)buf, sizeof(buf)), 2);
+        expect_str(buf, "v7");
+        expect_int(tndb_close(db), 1);
+    }
+
+    unlink(path);
+}
+END_TEST
+
+START_TEST(test_hash64)
+{
+    char *path = NTEST_TMPPATH("tndb_hash64.db");
+    char magic[9];
+
+    creat_db(path, TNDB_SIGNED | TNDB_HASH64);
+    read_magic(path, magic);
+    expect_str(magic, "tndb1.2\n");
+    check_db(path);
+
+    creat_db(path, TNDB_SIGNED | TNDB_HASH64 | TNDB_FPRINT);
+    check_db(path);
+
+    creat_db(path, TNDB_HASH64 | TNDB_MPHF | TNDB_FPRINT);
+    check_db(path);
+
+    unlink(path);
+}
+END_TEST
+
+START_TEST(test_htscale)
+{
+    char *path = NTEST_TMPPATH("tndb_htscale.db");
+    const char *keys[] = { "key0", "nokey", "key1999", "key42" };
+    unsigned int klens[4], vlens[4];
+    uint32_t voffs[4];
+    struct tndb *db;
+    char magic[9];
+    int i;
+
+    creat_db(path, TNDB_SIGNED | TNDB_HTSCALE);
+    read_magic(path, magic);
+    expect_str(magic, "tndb1.1\n");
+    check_db(path);
+
+    creat_db(path, TNDB_SIGNED | TNDB_HTSCALE | TNDB_FPRINT);
+    check_db(path);
+
+    creat_db(path, TNDB_HTSCALE | TNDB_HASH64 | TNDB_FPRINT);
+    check_db(path);
+
+    db = tndb_open(path);
+    expect_notnull(db);
+
+    for (i = 0; i < 4; i++)
+        klens[i] = strlen(keys[i]);
+
+    expect_int(tndb_mget(db, 4, keys, klens, voffs, vlens, NULL), 3);
+    expect_int(vlens[0], 4);
+    expect_int(vlens[1], 0);
+    expect_int(vlens[2], 7);
+    expect_int(vlens[3], 5);
+    expect_int(tndb_close(db), 1);
+
+    /* empty one */
+    unlink(path);
+    db = tndb_creat(path, -1, TNDB_HTSCALE);
+    expect_notnull(db);
+    expect_int(tndb_close(db), 1);
+
+    db = tndb_open(path);
+    expect_notnull(db);
+    expect_int(tndb_get(db, "key0", 4, magic, sizeof(magic)), 0);
+    expect_int(tndb_close(db), 1);
+
+    unlink(path);
+}
+END_TEST
+
+START_TEST(test_bloom)
+{
+    char *path = NTEST_TMPPATH("tndb_bloom.db");
+    const char *keys[] = { "key3", "nokey", "key1999", "nokey2" };
+    unsigned int klens[4], vlens[4];
+    uint32_t voffs[4];
+    struct tndb *db;
+    char magic[9], buf[64];
+    int i;
+
+    creat_db(path, TNDB_SIGNED | TNDB_BLOOM);
+    read_magic(path, magic);
+    expect_str(magic, "tndb1.1\n");
+    check_db(path);
+
+    db = tndb_open_ex(path, TNDB_O_MMAP);
+    expect_notnull(db);
+    expect_int(tndb_get_str(db, "key7", (unsigned char*)buf, sizeof(buf)), 4);
+    expect_str(buf, "val7");
+    expect_int(tndb_get(db, "nokey", 5, buf, sizeof(buf)), 0);
+
+    for (i = 0; i < 4; i++)
+        klens[i] = strlen(keys[i]);
+
+    expect_int(tndb_mget(db, 4, keys, klens, voffs, vlens, NULL), 2);
+    expect_int(vlens[0], 4);
+    expect_int(vlens[1], 0);
+    expect_int(vlens[2], 7);
+    expect_int(vlens[3], 0);
+    expect_int(tndb_close(db), 1);
+
+    creat_db(path, TNDB_SIGNED | TNDB_BLOOM | TNDB_FPRINT | TNDB_HTSCALE);
+    check_db(path);
+
+    creat_db(path, TNDB_SIGNED | TNDB_BLOOM | TNDB_MPHF | TNDB_HASH64);
+    check_db(path);
+
+    creat_db(path, TNDB_SIGNED | TNDB_BLOOM | TNDB_BLOCKZ);
+    check_db(path);
+
+    /* no hash table, no filter */
+    creat_db(path, TNDB_NOHASH | TNDB_BLOOM);
+    read_magic(path, magic);
+    expect_str(magic, "tndb1.0\n");
+
+    unlink(path);
+}
+END_TEST
+
+static void check_kit(const char *path, unsigned flags)
+{
+    struct tndb *db;
+    struct tndb_kit it;
+    char key[TNDB_KEY_MAX + 1], prev[TNDB_KEY_MAX + 1], buf[64];
+    unsigned int klen, vlen;
+    uint32_t voff;
+    int n;
+
+    db = tndb_open_ex(path, flags);
+    expect_notnull(db);
+
+    /* ordered, every key once */
+    expect_int(tndb_kit_start(db, &it), 1);
+    *prev = '\0';
+    n = 0;
+    while (tndb_kit_get_voff(&it, key, &klen, &voff, &vlen) > 0) {
+        expect_int(strcmp(prev, key) < 0, 1);
+        expect_int(klen, strlen(key));
+        strcpy(prev, key);
+        n++;
+    }
+    expect_int(n, NKEYS);
+
+    expect_int(tndb_kit_seek(db, &it, "key5", 4), 1);
+    vlen = sizeof(buf);
+    expect_int(tndb_kit_get(&it, key, &klen, buf, &vlen), 1);
+    expect_str(key, "key5");
+    expect_str(buf, "val5");
+
+    expect_int(tndb_kit_seek(db, &it, "key9999", 7), 1);
+    expect_int(tndb_kit_get_voff(&it, key, &klen, &voff, &vlen), 0);
+
+    /* key19, key190..key199, key1900..key1999 */
+    expect_int(tndb_kit_prefix(db, &it, "key19", 5), 1);
+    n = 0;
+    while (tndb_kit_get_voff(&it, key, &klen, &voff, &vlen) > 0) {
+        expect_int(strncmp(key, "key19", 5), 0);
+        n++;
+    }
+    expect_int(n, 111);
+
+    expect_int(tndb_kit_prefix(db, &it, "nokey", 5), 1);
+    expect_int(tndb_kit_get_voff(&it, key, &klen, &voff, &vlen), 0);
+
+    expect_int(tndb_close(db), 1);
+}
+
+START_TEST(test_keyidx)
+{
+    char *path = NTEST_TMPPATH("tndb_keyidx.db");
+    struct tndb *db;
+    struct tndb_kit it;
+    char key[TNDB_KEY_MAX + 1], buf[64];
+    unsigned int klen, vlen;
+
+    creat_db(path, TNDB_SIGNED | TNDB_KEYIDX);
+    check_db(path);
+    check_kit(path, 0);
+    check_kit(path, TNDB_O_MMAP);
+
+    creat_db(path, TNDB_SIGNED | TNDB_KEYIDX | TNDB_BLOOM | TNDB_BLOCKZ);
+    check_db(path);
+    check_kit(path, 0);
+
+    creat_db(path, TNDB_KEYIDX | TNDB_MPHF);
+    check_kit(path, 0);
+
+    /* no index */
+    creat_db(path, 0);
+    db = tndb_open(path);
+    expect_notnull(db);
+    expect_int(tndb_kit_start(db, &it), 0);
+    expect_int(tndb_close(db), 1);
+
+    /* the last duplicate wins */
+    unlink(path);
+    db = tndb_creat(path, -1, TNDB_KEYIDX);
+    expect_notnull(db);
+    expect_int(tndb_put(db, "b", 1, "v1", 2), 1);
+    expect_int(tndb_put(db, "ab", 2, "v2", 2), 1);
+    expect_int(tndb_put(db, "b", 1, "v3", 2), 1);
+    expect_int(tndb_put(db, "a", 1, "v4", 2), 1);
+    expect_int(tndb_close(db), 1);
+
+    db = tndb_open(path);
+    expect_notnull(db);
+    expect_int(tndb_kit_start(db, &it), 1);
+
+    vlen = sizeof(buf);
+    expect_int(tndb_kit_get(&it, key, &klen, buf, &vlen), 1);
+    expect_str(key, "a");
+    vlen = sizeof(buf);
+    expect_int(tndb_kit_get(&it, key, &klen, buf, &vlen), 1);
+    expect_str(key, "ab");
+    vlen = sizeof(buf);
+    expect_int(tndb_kit_get(&it, key, &klen, buf, &vlen), 1);
+    expect_str(key, "b");
+    expect_str(buf, "v3");
+    vlen = sizeof(buf);
+    expect_int(tndb_kit_get(&it, key, &klen, buf, &vlen), 0);
+    expect_int(tndb_close(db), 1);
+
+    unlink(path);
+}
+END_TEST
+
+START_TEST(test_ordidx)
+{
+    char *path = NTEST_TMPPATH("tndb_ordidx.db");
+    const unsigned flags[] = { 0, TNDB_NOHASH, TNDB_BLOCKZ | TNDB_KEYIDX };
+    char key[TNDB_KEY_MAX + 1], val[64], buf[64];
+    unsigned int klen, vlen, f;
+    struct tndb_it it;
+    struct tndb *db;
+    uint32_t voff;
+    int i;
+
+    for (f = 0; f < sizeof(flags) / sizeof(flags[0]); f++) {
+        creat_db(path, TNDB_SIGNED | TNDB_ORDIDX | flags[f]);
+        if ((flags[f] & TNDB_NOHASH) == 0)
+            check_db(path);
+
+        db = tndb_open(path);
+        expect_notnull(db);
+        expect_int(tndb_verify(db), 1);
+
+        for (i = NKEYS - 1; i >= 0; i -= 7) {
+            n_snprintf(val, sizeof(val), "key%d", i);
+            expect_int(tndb_get_nth(db, i, key, &klen, &voff, &vlen), 1);
+            expect_str(key, val);
+            expect_int(klen, strlen(val));
+
+            n_snprintf(val, sizeof(val), "val%d", i);
+            expect_int(vlen, strlen(val));
+            expect_int(tndb_read(db, voff, buf, vlen), vlen);
+            expect_int(memcmp(buf, val, vlen), 0);
+        }
+        expect_int(tndb_get_nth(db, NKEYS, key, &klen, &voff, &vlen), 0);
+
+        /* resumed scan */
+        expect_int(tndb_it_start_nth(db, &it, NKEYS - 10), 1);
+        for (i = NKEYS - 10; i < NKEYS; i++) {
+            vlen = sizeof(buf);
+            expect_int(tndb_it_get(&it, key, &klen, buf, &vlen), 1);
+            n_snprintf(val, sizeof(val), "val%d", i);
+            expect_str(buf, val);
+        }
+        vlen = sizeof(buf);
+        expect_int(tndb_it_get(&it, key, &klen, buf, &vlen), 0);
+        expect_int(tndb_it_start_nth(db, &it, NKEYS), 0);
+
+        expect_int(tndb_close(db), 1);
+    }
+
+    /* no index */
+    creat_db(path, 0);
+    db = tndb_open(path);
+    expect_notnull(db);
+    expect_int(tndb_get_nth(db, 0, key, &klen, &voff, &vlen), 0);
+    expect_int(tndb_it_start_nth(db, &it, 1), 0);
+    expect_int(tndb_it_start_nth(db, &it, 0), 1);
+    expect_int(tndb_close(db), 1);
+
+    unlink(path);
+}
+END_TEST
+
+START_TEST(test_newer_format)
+{
+    char *path = NTEST_TMPPATH("tndb_fmt19.db");
+    FILE *f;
+
+    creat_db(path, 0);
+
+    f = fopen(path, "r+b");
+    expect_notnull(f);
+    expect_int(fwrite("tndb1.9\n", 1, 8, f), 8);
+    fclose(f);
+
+    expect_null(tndb_open(path));
+    unlink(path);
+}
+END_TEST
+
+static void corrupt_byte(const char *path, long offs)
+{
+    FILE *f = fopen(path, "r+b");
+    int c;
+
+    expect_notnull(f);
+    if (offs < 0) {
+        fseek(f, 0, SEEK_END);
+        offs += ftell(f);
+    }
+
+    fseek(f, offs, SEEK_SET);
+    c = fgetc(f);
+    fseek(f, offs, SEEK_SET);
+    fputc(c ^ 0x5a, f);
+    fclose(f);
+}
+
+static int verify_db(const char *path)
+{
+    struct tndb *db = tndb_open(path);
+    int rc;
+
+    expect_notnull(db);
+    rc = tndb_verify(db);
+    tndb_close(db);
+    return rc;
+}
+
+START_TEST(test_sign_tree)
+{
+    char *path = NTEST_TMPPATH("tndb_tree.db");
+    char *gzpath = NTEST_TMPPATH("tndb_tree.db.gz");
+    char key[64], val[64], magic[9];
+    struct tndb *db;
+    long offs[] = { 200, 5000, -100, -(1024 * 1024 + 7), 0 };
+    int i, j;
+
+    /* not readable by tndb unaware of tree signature */
+    creat_db(path, TNDB_SIGN_TREE);
+    read_magic(path, magic);
+    expect_str(magic, "tndb1.1\n");
+    check_db(path);
+
+    creat_db(path, TNDB_SIGN_TREE | TNDB_SIGN_DIGEST | TNDB_FPRINT);
+    check_db(path);
+
+    creat_db(path, TNDB_SIGN_TREE | TNDB_BLOCKZ | TNDB_BLOOM | TNDB_KEYIDX |
+             TNDB_ORDIDX);
+    check_db(path);
+
+    creat_db(gzpath, TNDB_SIGN_TREE | TNDB_BLOOM);
+    check_db(gzpath);
+    unlink(gzpath);
+
+    /* many chunks */
+    for (i = 0; offs[i]; i++) {
+        unlink(path);
+        db = tndb_creat(path, -1, TNDB_SIGN_TREE);
+        expect_notnull(db);
+
+        for (j = 0; j < 100000; j++) {
+            int klen = n_snprintf(key, sizeof(key), "key%d", j);
+            int vlen = n_snprintf(val, sizeof(val), "value %d of tree signed db", j);
+            expect_int(tndb_put(db, key, klen, val, vlen), 1);
+        }
+        expect_int(tndb_close(db), 1);
+
+        expect_int(verify_db(path), 1);
+        corrupt_byte(path, offs[i]);
+        expect_int(verify_db(path), 0);
+    }
+
+    unlink(path);
+}
+END_TEST
+
+static void creat_big_db(const char *path, unsigned flags)
+{
+    struct tndb *db;
+    char key[64], val[64];
+    int i;
+
+    unlink(path);
+    db = tndb_creat(path, -1, flags);
+    expect_notnull(db);
+
+    for (i = 0; i < 100000; i++) {
+        int klen = n_snprintf(key, sizeof(key), "key%d", i);
+        int vlen = n_snprintf(val, sizeof(val), "value %d of merkle signed db", i);
+        expect_int(tndb_put(db, key, klen, val, vlen), 1);
+    }
+    expect_int(tndb_close(db), 1);
+}
+
+static int get_big_db(struct tndb *db, int i)
+{
+    char key[64], val[64], buf[64];
+    int klen, vlen, n;
+
+    klen = n_snprintf(key, sizeof(key), "key%d", i);
+    vlen = n_snprintf(val, sizeof(val), "value %d of merkle signed db", i);
+
+    n = tndb_get(db, key, klen, buf, sizeof(buf));
+    return n == vlen && memcmp(buf, val, vlen) == 0;
+}
+
+START_TEST(test_sign_merkle)
+{
+    char *path = NTEST_TMPPATH("tndb_mrkl.db");
+    char *gzpath = NTEST_TMPPATH("tndb_mrkl.db.gz");
+    unsigned oflags[] = { 0, TNDB_O_MMAP }, i;
+    char magic[9];
+    struct tndb *db;
+
+    creat_db(path, TNDB_SIGN_MERKLE);
+    read_magic(path, magic);
+    expect_str(magic, "tndb1.1\n");
+    check_db(path);
+
+    creat_db(path, TNDB_SIGN_MERKLE | TNDB_BLOOM | TNDB_KEYIDX | TNDB_ORDIDX);
+    check_db(path);
+
+    /* not available with compressed blocks, plain tree is used */
+    creat_db(path, TNDB_SIGN_MERKLE | TNDB_BLOCKZ);
+    check_db(path);
+    corrupt_byte(path, -100);
+    expect_int(verify_db(path), 0);
+
+    /* compressed stream is verified as a whole */
+    creat_db(gzpath, TNDB_SIGN_MERKLE);
+    check_db(gzpath);
+    unlink(gzpath);
+
+    for (i = 0; i < sizeof(oflags) / sizeof(oflags[0]); i++) {
+        /* corrupted data: only lookups of the last chunk fail */
+        creat_big_db(path, TNDB_SIGN_MERKLE);
+        corrupt_byte(path, -100);
+
+        db = tndb_open_ex(path, oflags[i]);
+        expect_notnull(db);
+        expect_int(get_big_db(db, 0), 1);
+        expect_int(get_big_db(db, 1000), 1);
+        expect_int(get_big_db(db, 99999), 0);
+        expect_int(get_big_db(db, 0), 1);
+        expect_int(tndb_verify(db), 0);
+        tndb_close(db);
+
+        /* corrupted index: the first lookup fails */
+        creat_big_db(path, TNDB_SIGN_MERKLE);
+        corrupt_byte(path, 200);
+
+        db = tndb_open_ex(path, oflags[i]);
+        expect_notnull(db);
+        expect_int(get_big_db(db, 0), 0);
+        tndb_close(db);
+    }
+
+    unlink(path);
+}
+END_TEST
+
+static int count_files(const char *dir)
+{
+    struct dirent *ent;
+    DIR *d;
+    int n = 0;
+
+    if ((d = opendir(dir)) == NULL)
+        return -1;
+
+    while ((ent = readdir(d)) != NULL)
+        if (*ent->d_name != '.')
+            n++;
+
+    closedir(d);
+    return n;
+}
+
+static int nlookups, nstores;
+
+static int count_lookup(const char *path, const char *key, void *arg)
+{
+    (void)path;
+    nlookups++;
+    return strcmp(key, arg) == 0;
+}
+
+static void count_store(const char *path, const char *key, void *arg)
+{
+    (void)path;
+    nstores++;
+    n_snprintf(arg, 128, "%s", key);
+}
+
+START_TEST(test_verify_cache)
+{
+    char *path = NTEST_TMPPATH("tndb_vrfy.db");
+    char *cachedir = NTEST_TMPPATH("tndb_vrfy_cache");
+    char vdir[PATH_MAX], mdpath[PATH_MAX], cmd[PATH_MAX + 16], key[128] = "";
+    unsigned flags[] = { TNDB_SIGN_DIGEST, TNDB_SIGN_TREE,
+                         TNDB_SIGN_DIGEST | TNDB_BLOOM }, i;
+    struct tndb_verify_cache vc = { count_lookup, count_store, key };
+    struct tndb_verify_cache novc = { NULL, NULL, NULL };
+
+    n_snprintf(cmd, sizeof(cmd), "rm -rf %s", cachedir);
+    expect_int(system(cmd), 0);
+    expect_int(tndb_set_cachedir(cachedir), 1);
+    n_snprintf(vdir, sizeof(vdir), "%s/verified", cachedir);
+    n_snprintf(mdpath, sizeof(mdpath), "%s.md5", path);
+
+    /* lookup creates nothing */
+    creat_db(path, TNDB_SIGN_DIGEST);
+    corrupt_byte(path, -100);
+    expect_int(verify_db(path), 0);
+    expect_int(access(cachedir, F_OK), -1);
+
+    for (i = 0; i < sizeof(flags) / sizeof(flags[0]); i++) {
+        creat_db(path, flags[i]);
+        expect_int(verify_db(path), 1);
+        expect_int(count_files(vdir), 1);
+        expect_int(verify_db(path), 1);
+        expect_int(count_files(vdir), 1);
+
+        /* modified file is digested again */
+        corrupt_byte(path, -100);
+        expect_int(verify_db(path), 0);
+        corrupt_byte(path, -100);
+        expect_int(verify_db(path), 1);
+        expect_int(count_files(vdir), 1);
+    }
+    expect_int(access(mdpath, F_OK), -1);
+
+    /* nothing to verify in unsigned db */
+    creat_db(path, 0);
+    expect_int(verify_db(path), 1);
+
+    tndb_set_verify_cache(&vc);
+    creat_db(path, TNDB_SIGN_DIGEST);
+    expect_int(verify_db(path), 1);
+    expect_int(verify_db(path), 1);
+    expect_int(nlookups, 2);
+    expect_int(nstores, 1);
+
+    tndb_set_verify_cache(&novc);
+    expect_int(verify_db(path), 1);
+    corrupt_byte(path, 100);
+    expect_int(verify_db(path), 0);
+    expect_int(nlookups, 2);
+
+    tndb_set_verify_cache(NULL);
+    expect_int(tndb_set_cachedir(NULL), 1);
+    expect_int(system(cmd), 0);
+    unlink(path);
+}
+END_TEST
+
+static void verified(struct tndb *db, int ok, void *arg)
+{
+    int *result = arg;
+
+    expect_int(tndb_verify_poll(db), ok);
+    *result = ok;
+}
+
+START_TEST(test_verify_async)
+{
+    char *path = NTEST_TMPPATH("tndb_async.db");
+    char *gzpath = NTEST_TMPPATH("tndb_async.db.gz");
+    char *cachedir = NTEST_TMPPATH("tndb_async_cache");
+    char cmd[PATH_MAX * 4];
+    struct tndb_verify_cache novc = { NULL, NULL, NULL };
+    unsigned oflags[] = { 0, TNDB_O_MMAP, TNDB_O_CONCURRENT }, i;
+    struct tndb *db;
+    int result;
+
+    tndb_set_verify_cache(&novc);
+
+    for (i = 0; i < sizeof(oflags) / sizeof(oflags[0]); i++) {
+        creat_big_db(path, TNDB_SIGN_DIGEST);
+
+        /* lookups wait for verification */
+        result = -1;
+        db = tndb_open_ex(path, oflags[i]);
+        expect_notnull(db);
+        expect_int(tndb_verify_async(db, 0, verified, &result), 1);
+        expect_int(tndb_verify_async(db, 0, NULL, NULL), 0);
+        expect_int(get_big_db(db, 5), 1);
+        expect_int(tndb_verify_poll(db), 1);
+        expect_int(tndb_verify(db), 1);
+        tndb_close(db);
+        expect_int(result, 1);
+
+        /* or are served meanwhile */
+        result = -1;
+        db = tndb_open_ex(path, oflags[i]);
+        expect_notnull(db);
+        expect_int(tndb_verify_async(db, TNDB_VA_READ, verified, &result), 1);
+        expect_int(get_big_db(db, 99999), 1);
+        expect_int(tndb_verify_wait(db), 1);
+        expect_int(get_big_db(db, 0), 1);
+        tndb_close(db);
+        expect_int(result, 1);
+
+        corrupt_byte(path, -100);
+
+        db = tndb_open_ex(path, oflags[i]);
+        expect_notnull(db);
+        expect_int(tndb_verify_async(db, 0, NULL, NULL), 1);
+        expect_int(get_big_db(db, 0), 0);
+        expect_int(tndb_verify_poll(db), 0);
+        tndb_close(db);
+
+        db = tndb_open_ex(path, oflags[i]);
+        expect_notnull(db);
+        expect_int(tndb_verify_async(db, TNDB_VA_READ, NULL, NULL), 1);
+        expect_int(tndb_verify_wait(db), 0);
+        expect_int(get_big_db(db, 0), 0);
+        expect_int(get_big_db(db, 1), 0);
+        tndb_close(db);
+
+        /* values cached before verification failed are not served */
+        db = tndb_open_ex(path, oflags[i]);
+        expect_notnull(db);
+        expect_int(tndb_set_vcache(db, 1024 * 1024), 1);
+        expect_int(tndb_verify_async(db, TNDB_VA_READ, NULL, NULL), 1);
+        get_big_db(db, 0);
+        expect_int(tndb_verify_wait(db), 0);
+        expect_int(get_big_db(db, 0), 0);
+        tndb_close(db);
+    }
+
+    /* path replaced by a copy, which is not db's file */
+    creat_big_db(path, TNDB_SIGN_DIGEST);
+    db = tndb_open(path);
+    expect_notnull(db);
+    n_snprintf(cmd, sizeof(cmd), "cp %s %s.tmp && mv %s.tmp %s",
+               path, path, path, path);
+    expect_int(system(cmd), 0);
+    expect_int(tndb_verify_async(db, 0, NULL, NULL), 1);
+    expect_int(tndb_verify_wait(db), 0);
+    tndb_close(db);
+
+    /* compressed one, read as is and as inflated copy */
+    expect_int(tndb_set_cachedir(cachedir), 1);
+    creat_db(gzpath, TNDB_SIGN_DIGEST);
+    for (i = 0; i < 2; i++) {
+        db = tndb_open_ex(gzpath, i ? TNDB_O_INFLATE_CACHE : 0);
+        expect_notnull(db);
+        expect_int(tndb_verify_async(db, 0, NULL, NULL), 1);
+        expect_int(tndb_verify_wait(db), 1);
+        tndb_close(db);
+    }
+    expect_int(tndb_set_cachedir(NULL), 1);
+    n_snprintf(cmd, sizeof(cmd), "rm -rf %s", cachedir);
+    expect_int(system(cmd), 0);
+    unlink(gzpath);
+
+    /* nothing to verify, done at once */
+    creat_db(path, 0);
+    result = -1;
+    db = tndb_open(path);
+    expect_notnull(db);
+    expect_int(tndb_verify_async(db, 0, verified, &result), 1);
+    expect_int(result, 1);
+    expect_int(tndb_verify_poll(db), 1);
+    tndb_close(db);
+
+    tndb_set_verify_cache(NULL);
+    unlink(path);
+}
+END_TEST
+
+/* header is decoded from one read, it must not run past the data read */
+START_TEST(test_truncated_header)
+{
+    char *path = NTEST_TMPPATH("tndb_trunc.db");
+    int sizes[] = { 4, 10, 20, 30, 0 }, i;
+
+    for (i = 0; sizes[i]; i++) {
+        creat_db(path, TNDB_SIGN_DIGEST | TNDB_FPRINT | TNDB_BLOOM);
+        expect_int(truncate(path, sizes[i]), 0);
+        expect_null(tndb_open(path));
+        unlink(path);
+    }
+
+    creat_db(path, TNDB_SIGN_DIGEST | TNDB_FPRINT | TNDB_BLOOM);
+    check_db(path);
+    unlink(path);
+}
+END_TEST
+
+NTEST_RUNNER("tndb-format",
+             test_default_format,
+             test_fprint,
+             test_blockz,
+             test_mphf,
+             test_hash64,
+             test_htscale,
+             test_bloom,
+             test_keyidx,
+             test_ordidx,
+             test_newer_format,
+             test_truncated_header,
+             test_sign_tree,
+             test_sign_merkle,
+             test_verify_cache,
+             test_verify_async
+);
@@ -7,7 +7,9 @@
 #include <string.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <pthread.h>
 #include <sys/stat.h>
+#include <dirent.h>
 
 #include <trurl/narray.h>
 #include <trurl/nmalloc.h>
@@ -181,7 +183,7 @@ START_TEST(test_iterator_rget)
     char key[32], val[32];
     char iter_key[TNDB_KEY_MAX + 1];
     void *iter_val = NULL;
-    unsigned int klen, vlen;
+    unsigned int klen, vlen = 0;
     struct tndb_it it;
     int i, count = 0;
     int nrec = 50;
@@ -276,6 +278,110 @@ START_TEST(test_iterator_get)
 }
 END_TEST
 
+static void iterator_ref_check(const char *path, unsigned flags, int nrec,
+                               int bigsize)
+{
+    struct tndb *db;
+    struct tndb_it it;
+    const void *kp, *vp;
+    char key[32], val[32], iter_val[512];
+    unsigned int klen, vlen;
+    int i, rc;
+
+    db = tndb_open_ex(path, flags);
+    expect_notnull(db);
+
+    expect_int(tndb_it_start(db, &it), 1);
+    for (i = 0; i < nrec; i++) {
+        int n = snprintf(key, sizeof(key), "key%.5d", i);
+
+        expect_int(tndb_it_get_ref(&it, &kp, &klen, &vp, &vlen), 1);
+        expect_int(klen, n);
+        expect_int(memcmp(kp, key, n), 0);
+
+        if (i == nrec / 2) {    /* bigger than read-ahead buffer */
+            expect_int(vlen, bigsize);
+            expect_int(((const char *)vp)[bigsize - 1], 'x');
+
+        } else {
+            n = snprintf(val, sizeof(val), "val%.5d", i);
+            expect_int(vlen, n);
+            expect_int(memcmp(vp, val, n), 0);
+        }
+    }
+    expect_int(tndb_it_get_ref(&it, &kp, &klen, &vp, &vlen), 0);
+
+    /* buffered copying iterator */
+    expect_int(tndb_it_start(db, &it), 1);
+    for (i = 0; i < nrec; i++) {
+        char iter_key[TNDB_KEY_MAX + 1];
+
+        if (i == nrec / 2) {
+            void *big = NULL;
+
+            vlen = 0;
+            expect_int(tndb_it_rget(&it, iter_key, &klen, &big, &vlen), 1);
+            expect_int(vlen, bigsize);
+            free(big);
+            continue;
+        }
+
+        vlen = sizeof(iter_val);
+        rc = tndb_it_get(&it, iter_key, &klen, iter_val, &vlen);
+        expect_int(rc, 1);
+        snprintf(val, sizeof(val), "val%.5d", i);
+        expect_str(iter_val, val);
+    }
+
+    expect_int(tndb_close(db), 1);
+}
+
+START_TEST(test_iterator_ref)
+{
+    struct tndb *db;
+    char key[32], val[32], *big;
+    int i, nrec = 50000, bigsize = 300 * 1024;
+    char *path = NTEST_TMPPATH("tndb_itref.db");
+
+    big = n_malloc(bigsize);
+    memset(big, 'x', bigsize);
+
+    unlink(path);
+    db = tndb_creat(path, -1, 0);
+    expect_notnull(db);
+
+    for (i = 0; i < nrec; i++) {
+        int klen = snprintf(key, sizeof(key), "key%.5d", i);
+        int vlen = snprintf(val, sizeof(val), "val%.5d", i);
+
+        if (i == nrec / 2)
+            expect_int(tndb_put(db, key, klen, big, bigsize), 1);
+        else
+            expect_int(tndb_put(db, key, klen, val, vlen), 1);
+    }
+    expect_int(tndb_close(db), 1);
+    free(big);
+
+    iterator_ref_check(path, 0, nrec, bigsize);
+    iterator_ref_check(path, TNDB_O_MMAP, nrec, bigsize);
+
+    /* views would not survive other threads */
+    db = tndb_open_ex(path, TNDB_O_CONCURRENT);
+    expect_notnull(db);
+    {
+        struct tndb_it it;
+        const void *kp, *vp;
+        unsigned int klen, vlen;
+
+        expect_int(tndb_it_start(db, &it), 1);
+        expect_int(tndb_it_get_ref(&it, &kp, &klen, &vp, &vlen), -1);
+    }
+    expect_int(tndb_close(db), 1);
+
+    unlink(path);
+}
+END_TEST
+
 START_TEST(test_get_voff)
 {
     struct tndb *db;
@@ -309,6 +415,458 @@ START_TEST(test_get_voff)
 }
 END_TEST
 
+static void inflate_check(const char *path, unsigned flags, int nrec)
+{
+    struct tndb *db;
+    char key[32], val[32], buf[32];
+    const void *ref;
+    unsigned int vlen;
+    int i;
+
+    db = tndb_open_ex(path, flags);
+    expect_notnull(db);
+    expect_int(tndb_verify(db), 1);
+
+    for (i = nrec - 1; i >= 0; i--) {
+        snprintf(key, sizeof(key), "key%.3d", i);
+        snprintf(val, sizeof(val), "val%.3d", i);
+
+        expect_int(tndb_get(db, key, strlen(key), buf, sizeof(buf)), (int)strlen(val));
+        expect_int(memcmp(buf, val, strlen(val)), 0);
+    }
+
+    /* served from memory or mapping of cached copy */
+    expect_int(tndb_get_ref(db, "key001", 6, &ref, &vlen), 1);
+    expect_int(memcmp(ref, "val001", vlen), 0);
+    expect_int(tndb_close(db), 1);
+}
+
+static int count_files(const char *dir)
+{
+    struct dirent *ent;
+    DIR *d;
+    int n = 0;
+
+    if ((d = opendir(dir)) == NULL)
+        return -1;
+
+    /* verified databases are kept in subdirectory */
+    while ((ent = readdir(d)) != NULL)
+        if (*ent->d_name != '.' && strcmp(ent->d_name, "verified") != 0)
+            n++;
+
+    closedir(d);
+    return n;
+}
+
+START_TEST(test_inflate)
+{
+    struct tndb *db;
+    char key[32], val[32];
+    int i, pass, nrec = 300;
+    char *path = NTEST_TMPPATH("tndb_inflate.db.gz");
+    char *cachedir = NTEST_TMPPATH("tndb_cache");
+    char cmd[PATH_MAX + 16];
+
+    snprintf(cmd, sizeof(cmd), "rm -rf %s", cachedir);
+    expect_int(system(cmd), 0);
+    expect_int(tndb_set_cachedir(cachedir), 1);
+
+    for (pass = 0; pass < 2; pass++) {
+        unlink(path);
+        db = tndb_creat(path, -1, TNDB_SIGN_DIGEST);
+        expect_notnull(db);
+
+        for (i = 0; i < nrec; i++) {
+            snprintf(key, sizeof(key), "key%.3d", i);
+            snprintf(val, sizeof(val), "val%.3d", i);
+            expect_int(tndb_put(db, key, strlen(key), val, strlen(val)), 1);
+        }
+        expect_int(tndb_put(db, "pass", 4, &pass, sizeof(pass)), 1);
+        expect_int(tndb_close(db), 1);
+
+        inflate_check(path, TNDB_O_INFLATE, nrec);
+
+        /* created on first open, reused then */
+        inflate_check(path, TNDB_O_INFLATE_CACHE | TNDB_O_MMAP, nrec);
+        expect_int(count_files(cachedir), 1);
+        inflate_check(path, TNDB_O_INFLATE_CACHE | TNDB_O_MMAP, nrec);
+        expect_int(count_files(cachedir), 1);
+
+        sleep(1);               /* next pass must change mtime */
+    }
+
+    expect_int(tndb_set_cachedir(NULL), 1);
+    expect_int(system(cmd), 0);
+    unlink(path);
+}
+END_TEST
+
+START_TEST(test_get_ref)
+{
+    struct tndb *db;
+    char key[32], val[32];
+    const void *ref;
+    unsigned int vlen;
+    char buf[32];
+    int i, nrec = 100;
+    char *path = NTEST_TMPPATH("tndb_ref.db");
+
+    unlink(path);
+
+    db = tndb_creat(path, -1, TNDB_SIGN_DIGEST);
+    expect_notnull(db);
+
+    for (i = 0; i < nrec; i++) {
+        snprintf(key, sizeof(key), "key%.3d", i);
+        snprintf(val, sizeof(val), "val%.3d", i);
+        expect_int(tndb_put(db, key, strlen(key), val, strlen(val)), 1);
+    }
+    expect_int(tndb_close(db), 1);
+
+    /* not mapped */
+    db = tndb_open(path);
+    expect_notnull(db);
+    expect_int(tndb_get_ref(db, "key001", 6, &ref, &vlen), -1);
+    expect_int(tndb_close(db), 1);
+
+    db = tndb_open_ex(path, TNDB_O_MMAP);
+    expect_notnull(db);
+
+    for (i = 0; i < nrec; i++) {
+        snprintf(key, sizeof(key), "key%.3d", i);
+        snprintf(val, sizeof(val), "val%.3d", i);
+
+        expect_int(tndb_get_ref(db, key, strlen(key), &ref, &vlen), 1);
+        expect_int((int)vlen, (int)strlen(val));
+        expect_int(memcmp(ref, val, vlen), 0);
+
+        expect_int(tndb_get(db, key, strlen(key), buf, sizeof(buf)), (int)vlen);
+        expect_int(memcmp(buf, val, vlen), 0);
+    }
+
+    expect_int(tndb_get_ref(db, "missing", 7, &ref, &vlen), 0);
+    expect_null(ref);
+
+    expect_int(tndb_close(db), 1);
+    unlink(path);
+}
+END_TEST
+
+START_TEST(test_vcache)
+{
+    struct tndb *db;
+    char key[32], val[32], buf[32];
+    void *aval;
+    int i, pass, nrec = 100;
+    char *path = NTEST_TMPPATH("tndb_vcache.db");
+
+    unlink(path);
+
+    db = tndb_creat(path, -1, 0);
+    expect_notnull(db);
+
+    for (i = 0; i < nrec; i++) {
+        snprintf(key, sizeof(key), "key%.3d", i);
+        snprintf(val, sizeof(val), "val%.3d", i);
+        expect_int(tndb_put(db, key, strlen(key), val, strlen(val)), 1);
+    }
+    expect_int(tndb_close(db), 1);
+
+    db = tndb_open(path);
+    expect_notnull(db);
+
+    /* small enough to evict */
+    expect_int(tndb_set_vcache(db, 1024), 1);
+
+    for (pass = 0; pass < 3; pass++) {
+        for (i = 0; i < nrec; i++) {
+            int n = pass == 1 ? i % 10 : i; /* hot ones */
+
+            snprintf(key, sizeof(key), "key%.3d", n);
+            snprintf(val, sizeof(val), "val%.3d", n);
+
+            expect_int(tndb_get(db, key, strlen(key), buf, sizeof(buf)), 6);
+            expect_int(memcmp(buf, val, 6), 0);
+
+            /* too small buffer */
+            expect_int(tndb_get(db, key, strlen(key), buf, 6), 0);
+
+            aval = NULL;
+            expect_int((int)tndb_get_all(db, key, strlen(key), &aval), 6);
+            expect_notnull(aval);
+            expect_int(memcmp(aval, val, 6), 0);
+            free(aval);
+        }
+    }
+
+    expect_int(tndb_get(db, "missing", 7, buf, sizeof(buf)), 0);
+
+    expect_int(tndb_set_vcache(db, 0), 1);
+    expect_int(tndb_get(db, "key042", 6, buf, sizeof(buf)), 6);
+    expect_int(memcmp(buf, "val042", 6), 0);
+
+    expect_int(tndb_close(db), 1);
+    unlink(path);
+}
+END_TEST
+
+START_TEST(test_mget)
+{
+    const char *names[] = { "tndb_mget.db", "tndb_mget.db.gz", NULL };
+    char keybuf[40][32], key[32], val[32];
+    const char *keys[40];
+    unsigned int klens[40], vlens[40];
+    uint32_t voffs[40];
+    void *vals[40];
+    int i, j, nrec = 500;
+
+    /* every 5th key is missing, the last one is duplicated */
+    for (i = 0; i < 40; i++) {
+        int n = i < 39 ? i * 13 : 13;
+
+        if (i % 5 == 4)
+            n += nrec;
+
+        snprintf(keybuf[i], sizeof(keybuf[i]), "key%.4d", n);
+        keys[i] = keybuf[i];
+        klens[i] = strlen(keybuf[i]);
+    }
+
+    for (j = 0; names[j]; j++) {
+        char *path = NTEST_TMPPATH(names[j]);
+        struct tndb *db;
+        unsigned flags;
+
+        unlink(path);
+
+        db = tndb_creat(path, -1, 0);
+        expect_notnull(db);
+
+        for (i = 0; i < nrec; i++) {
+            snprintf(key, sizeof(key), "key%.4d", i);
+            snprintf(val, sizeof(val), "val%.4d", i);
+            expect_int(tndb_put(db, key, strlen(key), val, strlen(val)), 1);
+        }
+        expect_int(tndb_close(db), 1);
+
+        for (flags = 0; flags <= TNDB_O_MMAP; flags += TNDB_O_MMAP) {
+            db = tndb_open_ex(path, flags);
+            expect_notnull(db);
+
+            expect_int(tndb_mget(db, 40, keys, klens, voffs, vlens, NULL), 32);
+            expect_int(tndb_mget(db, 40, keys, klens, voffs, vlens, vals), 32);
+
+            for (i = 0; i < 40; i++) {
+                uint32_t voff;
+                unsigned int vlen;
+                int found = tndb_get_voff(db, keys[i], klens[i], &voff, &vlen);
+
+                expect_int(voffs[i], found ? voff : 0);
+                expect_int(vlens[i], found ? vlen : 0);
+
+                if (found) {
+                    snprintf(val, sizeof(val), "val%s", keys[i] + 3);
+                    expect_int(vlens[i], strlen(val));
+                    expect_int(memcmp(vals[i], val, vlens[i]), 0);
+                    free(vals[i]);
+                } else {
+                    expect_null(vals[i]);
+                }
+            }
+
+            expect_int(tndb_close(db), 1);
+        }
+        unlink(path);
+    }
+}
+END_TEST
+
+#define CONCURRENT_NREC     1000
+#define CONCURRENT_NTHREADS 4
+
+static void *concurrent_lookup(void *arg)
+{
+    struct tndb *db = arg;
+    char key[32], val[32], buf[32];
+    int i, nerr = 0;
+
+    for (i = 0; i < CONCURRENT_NREC + 10; i++) {
+        int n = (i * 7) % (CONCURRENT_NREC + 10); /* + some missing keys */
+        int nread;
+
+        snprintf(key, sizeof(key), "key%.4d", n);
+        snprintf(val, sizeof(val), "val%.4d", n);
+
+        nread = tndb_get(db, key, strlen(key), buf, sizeof(buf));
+        if (n >= CONCURRENT_NREC)
+            nerr += (nread != 0);
+        else
+            nerr += (nread != (int)strlen(val) || memcmp(buf, val, nread) != 0);
+    }
+
+    return (void*)(long)nerr;
+}
+
+struct split_arg {
+    struct tndb_part *part;
+    unsigned char    *seen;
+    int              nrec;
+};
+
+static void *split_scan(void *arg)
+{
+    struct split_arg *a = arg;
+    const void *kp, *vp;
+    unsigned int klen, vlen;
+    char key[32];
+    int nerr = 0, rc;
+
+    while ((rc = tndb_part_get_ref(a->part, &kp, &klen, &vp, &vlen)) > 0) {
+        int n;
+
+        n_snprintf(key, sizeof(key), "%.*s", klen, (const char *)kp);
+        n = atoi(key + 3);
+        if (n < 0 || n >= a->nrec || vlen != klen ||
+            memcmp(vp, "val", 3) != 0 || memcmp(key + 3, (const char *)vp + 3, klen - 3) != 0)
+            nerr++;
+        else
+            a->seen[n]++;       /* records of parts are disjoint */
+    }
+
+    return (void*)(long)(nerr + (rc < 0));
+}
+
+static void split_check(const char *path, unsigned int nparts, int nrec)
+{
+    struct tndb_part *parts[CONCURRENT_NTHREADS * 2];
+    struct split_arg args[CONCURRENT_NTHREADS * 2];
+    pthread_t threads[CONCURRENT_NTHREADS * 2];
+    unsigned char *seen;
+    struct tndb *db;
+    int i, n;
+
+    n_assert(nparts <= CONCURRENT_NTHREADS * 2);
+
+    db = tndb_open_ex(path, TNDB_O_CONCURRENT);
+    expect_notnull(db);
+
+    n = tndb_split(db, nparts, parts);
+    expect_int(n > 0 && n <= (int)nparts && n <= nrec, 1);
+
+    seen = n_calloc(nrec, 1);
+    for (i = 0; i < n; i++) {
+        args[i].part = parts[i];
+        args[i].seen = seen;
+        args[i].nrec = nrec;
+        expect_int(pthread_create(&threads[i], NULL, split_scan, &args[i]), 0);
+    }
+
+    for (i = 0; i < n; i++) {
+        void *nerr = NULL;
+        expect_int(pthread_join(threads[i], &nerr), 0);
+        expect_int((long)nerr, 0);
+        tndb_part_free(parts[i]);
+    }
+
+    for (i = 0; i < nrec; i++)
+        expect_int(seen[i], 1);
+
+    free(seen);
+    expect_int(tndb_close(db), 1);
+}
+
+START_TEST(test_split)
+{
+    char *path = NTEST_TMPPATH("tndb_split.db");
+    const unsigned flags[] = { 0, TNDB_NOHASH, TNDB_MPHF, TNDB_BLOCKZ,
+                               TNDB_ORDIDX | TNDB_NOHASH };
+    struct tndb_part *parts[4];
+    char key[32], val[32];
+    struct tndb *db;
+    unsigned int i;
+    int j;
+
+    for (i = 0; i < sizeof(flags) / sizeof(flags[0]); i++) {
+        unlink(path);
+        db = tndb_creat(path, -1, TNDB_SIGN_DIGEST | flags[i]);
+        expect_notnull(db);
+
+        for (j = 0; j < CONCURRENT_NREC; j++) {
+            int klen = snprintf(key, sizeof(key), "key%.4d", j);
+            snprintf(val, sizeof(val), "val%.4d", j);
+            expect_int(tndb_put(db, key, klen, val, klen), 1);
+        }
+        expect_int(tndb_close(db), 1);
+
+        split_check(path, CONCURRENT_NTHREADS, CONCURRENT_NREC);
+    }
+
+    /* more parts than records */
+    unlink(path);
+    db = tndb_creat(path, -1, 0);
+    expect_notnull(db);
+    expect_int(tndb_put(db, "key0", 4, "val0", 4), 1);
+    expect_int(tndb_put(db, "key1", 4, "val1", 4), 1);
+    expect_int(tndb_close(db), 1);
+    split_check(path, CONCURRENT_NTHREADS * 2, 2);
+
+    /* empty one */
+    unlink(path);
+    db = tndb_creat(path, -1, 0);
+    expect_notnull(db);
+    expect_int(tndb_close(db), 1);
+
+    db = tndb_open(path);
+    expect_notnull(db);
+    expect_int(tndb_split(db, 4, parts), 0);
+    expect_int(tndb_close(db), 1);
+
+    unlink(path);
+}
+END_TEST
+
+START_TEST(test_concurrent)
+{
+    const char *names[] = { "tndb_concurrent.db", "tndb_concurrent.db.gz", NULL };
+    pthread_t threads[CONCURRENT_NTHREADS];
+    char key[32], val[32];
+    int i, j;
+
+    for (j = 0; names[j]; j++) {
+        char *path = NTEST_TMPPATH(names[j]);
+        struct tndb *db;
+
+        unlink(path);
+
+        db = tndb_creat(path, -1, TNDB_SIGN_DIGEST);
+        expect_notnull(db);
+
+        for (i = 0; i < CONCURRENT_NREC; i++) {
+            snprintf(key, sizeof(key), "key%.4d", i);
+            snprintf(val, sizeof(val), "val%.4d", i);
+            expect_int(tndb_put(db, key, strlen(key), val, strlen(val)), 1);
+        }
+        expect_int(tndb_close(db), 1);
+
+        db = tndb_open_ex(path, TNDB_O_CONCURRENT);
+        expect_notnull(db);
+
+        for (i = 0; i < CONCURRENT_NTHREADS; i++)
+            expect_int(pthread_create(&threads[i], NULL, concurrent_lookup, db), 0);
+
+        for (i = 0; i < CONCURRENT_NTHREADS; i++) {
+            void *nerr = NULL;
+            expect_int(pthread_join(threads[i], &nerr), 0);
+            expect_int((long)nerr, 0);
+        }
+
+        expect_int(tndb_close(db), 1);
+        unlink(path);
+    }
+}
+END_TEST
+
 NTEST_RUNNER("tndb-lookup",
              test_get_all,
              test_get_str,
@@ -317,5 +875,12 @@ NTEST_RUNNER("tndb-lookup",
              test_max_key_length,
              test_iterator_rget,
              test_iterator_get,
-             test_get_voff
+             test_iterator_ref,
+             test_get_voff,
+             test_get_ref,
+             test_vcache,
+             test_mget,
+             test_concurrent,
+             test_split,
+             test_inflate
 );
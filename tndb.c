@@ -20,6 +20,9 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#ifdef HAVE_MMAP
+# include <sys/mman.h>
+#endif
 
 #include <openssl/evp.h>
 
@@ -60,6 +63,215 @@ uint32_t tndb_hash(const void *d, register uint8_t size)
     return j;
 }
 
+/* FNV-1a, independent of tndb_hash() */
+uint32_t tndb_fprint(const void *d, uint8_t size)
+{
+    uint32_t j = 2166136261U;
+    const unsigned char *p = d;
+
+    while (size != 0) {
+        size--;
+        j ^= *p++;
+        j *= 16777619U;
+    }
+
+    return j;
+}
+
+/*
+  64-bit hash in wyhash manner: 16 bytes are consumed per multiply-mix
+  step, words are loaded as little-endian ones to get the same values on
+  every architecture.
+*/
+static const uint64_t wy_secret[4] = {
+    0x2d358dccaa6c78a5ULL, 0x8bb84b93962eacc9ULL,
+    0x4b33a62ed433d4a3ULL, 0x4d5a2da51de1aa47ULL
+};
+
+static inline void wy_mum(uint64_t *a, uint64_t *b)
+{
+#ifdef __SIZEOF_INT128__
+    __uint128_t r = *a;
+
+    r *= *b;
+    *a = (uint64_t)r;
+    *b = (uint64_t)(r >> 64);
+#else
+    uint64_t ha = *a >> 32, hb = *b >> 32, la = (uint32_t)*a, lb = (uint32_t)*b;
+    uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+    uint64_t t = rl + (rm0 << 32), c = t < rl, lo, hi;
+
+    lo = t + (rm1 << 32);
+    c += lo < t;
+    hi = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+    *a = lo;
+    *b = hi;
+#endif
+}
+
+static inline uint64_t wy_mix(uint64_t a, uint64_t b)
+{
+    wy_mum(&a, &b);
+    return a ^ b;
+}
+
+static inline uint64_t wy_r8(const unsigned char *p)
+{
+    return (uint64_t)p[0] | (uint64_t)p[1] << 8 | (uint64_t)p[2] << 16 |
+        (uint64_t)p[3] << 24 | (uint64_t)p[4] << 32 | (uint64_t)p[5] << 40 |
+        (uint64_t)p[6] << 48 | (uint64_t)p[7] << 56;
+}
+
+static inline uint64_t wy_r4(const unsigned char *p)
+{
+    return (uint64_t)p[0] | (uint64_t)p[1] << 8 | (uint64_t)p[2] << 16 |
+        (uint64_t)p[3] << 24;
+}
+
+uint64_t tndb_hash64(const void *d, unsigned int size)
+{
+    const unsigned char *p = d;
+    uint64_t seed, a, b;
+    unsigned int i = size;
+
+    seed = wy_mix(wy_secret[0], wy_secret[1]);
+
+    if (size <= 16) {
+        if (size >= 4) {
+            a = (wy_r4(p) << 32) | wy_r4(p + ((size >> 3) << 2));
+            b = (wy_r4(p + size - 4) << 32) |
+                wy_r4(p + size - 4 - ((size >> 3) << 2));
+
+        } else if (size > 0) {
+            a = ((uint64_t)p[0] << 16) | ((uint64_t)p[size >> 1] << 8) |
+                p[size - 1];
+            b = 0;
+
+        } else {
+            a = b = 0;
+        }
+
+    } else {
+        if (i > 48) {
+            uint64_t see1 = seed, see2 = seed;
+
+            do {
+                seed = wy_mix(wy_r8(p) ^ wy_secret[1], wy_r8(p + 8) ^ seed);
+                see1 = wy_mix(wy_r8(p + 16) ^ wy_secret[2], wy_r8(p + 24) ^ see1);
+                see2 = wy_mix(wy_r8(p + 32) ^ wy_secret[3], wy_r8(p + 40) ^ see2);
+                p += 48;
+                i -= 48;
+            } while (i > 48);
+
+            seed ^= see1 ^ see2;
+        }
+
+        while (i > 16) {
+            seed = wy_mix(wy_r8(p) ^ wy_secret[1], wy_r8(p + 8) ^ seed);
+            i -= 16;
+            p += 16;
+        }
+
+        a = wy_r8(p + i - 16);
+        b = wy_r8(p + i - 8);
+    }
+
+    a ^= wy_secret[1];
+    b ^= seed;
+    wy_mum(&a, &b);
+
+    return wy_mix(a ^ wy_secret[0] ^ size, b ^ wy_secret[1]);
+}
+
+/*
+  Computes key hashes with db's hash function. With tndb_hash64()
+  bucket is selected by the top bits, entries keep the low half and
+  fingerprints the rest of them.
+*/
+void tndb_key_hash(const struct tndb_hdr *hdr, const void *key, uint8_t klen,
+                   struct tndb_khash *kh)
+{
+    if (hdr->hashid == TNDB_HASH_WY64) {
+        uint64_t h = tndb_hash64(key, klen);
+
+        kh->hv = (uint32_t)h;
+        kh->hv2 = (uint32_t)(h >> 32);
+        kh->hb = (kh->hv2 << 8) | (kh->hv2 >> 24);
+        return;
+    }
+
+    kh->hv = tndb_hash(key, klen);
+    kh->hb = kh->hv;
+    kh->hv2 = 0;
+    if (hdr->xflags & (TNDB_FPRINT | TNDB_MPHF | TNDB_BLOOM))
+        kh->hv2 = tndb_fprint(key, klen);
+}
+
+/* murmur3's finalizer */
+static inline uint32_t fmix32(uint32_t h)
+{
+    h ^= h >> 16;
+    h *= 0x85ebca6bU;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35U;
+    h ^= h >> 16;
+    return h;
+}
+
+/* TNDB_MPHF key hashes derived from tndb_key_hash() ones */
+void tndb_mph_hash(uint32_t hv, uint32_t hv2, uint32_t seed, uint32_t h[3])
+{
+    h[0] = fmix32(hv ^ fmix32(hv2 + seed));
+    h[1] = fmix32(hv2 ^ fmix32(hv + seed * 0x9e3779b9U));
+    h[2] = fmix32(hv + hv2 + seed * 0x7f4a7c15U) | 1;
+}
+
+/* block and bit selectors of key in TNDB_BLOOM filter */
+static inline uint32_t bloom_hash(uint32_t nblocks, uint32_t hv, uint32_t hv2,
+                                  uint32_t *bits)
+{
+    uint32_t a = fmix32(hv ^ fmix32(hv2 + 0x9e3779b9U));
+
+    *bits = fmix32(hv2 ^ fmix32(hv + 0x7f4a7c15U));
+    return (uint32_t)(((uint64_t)a * nblocks) >> 32);
+}
+
+/* i-th of key's bits within the block, step is odd so they are distinct */
+#define BLOOM_BIT(bits, i) (((bits) + (i) * (((bits) >> 16) | 1)) & 511)
+
+void tndb_bloom_add(unsigned char *bloom, uint32_t nblocks,
+                    uint32_t hv, uint32_t hv2)
+{
+    uint32_t bits, i;
+    unsigned char *blk;
+
+    blk = bloom + bloom_hash(nblocks, hv, hv2, &bits) * TNDB_BLOOM_BLKSIZE;
+
+    for (i=0; i < TNDB_BLOOM_K; i++) {
+        uint32_t bit = BLOOM_BIT(bits, i);
+        blk[bit >> 3] |= 1 << (bit & 7);
+    }
+}
+
+/* returns 0 if key is surely absent */
+int tndb_bloom_test(const unsigned char *bloom, uint32_t nblocks,
+                    uint32_t hv, uint32_t hv2)
+{
+    const unsigned char *blk;
+    uint32_t bits, i;
+
+    blk = bloom + bloom_hash(nblocks, hv, hv2, &bits) * TNDB_BLOOM_BLKSIZE;
+
+    for (i=0; i < TNDB_BLOOM_K; i++) {
+        uint32_t bit = BLOOM_BIT(bits, i);
+
+        if ((blk[bit >> 3] & (1 << (bit & 7))) == 0)
+            return 0;
+    }
+
+    return 1;
+}
+
 int tndb_bin2hex(char *hex, int hex_size, const unsigned char *bin, int bin_size)
 {
     int i, n = 0, nn = 0;
@@ -96,11 +308,100 @@ void tndb_sign_init(struct tndb_sign *sign)
     //printf("%p %p >> INIT\n", sign, sign->ctx);
 }
 
+/*
+  TNDB_SIGN_TREE: signed content is split into regions (data, header,
+  index), regions into TNDB_SIGN_CHUNK long chunks, each of them is
+  digested separately, so they could be verified in parallel. The root
+  digest is computed over chunks' digests.
+*/
+void tndb_sign_init_tree(struct tndb_sign *sign)
+{
+    EVP_MD_CTX *ctx;
+
+    memset(sign, 0, sizeof(*sign));
+
+    ctx = EVP_MD_CTX_create();
+    EVP_DigestInit(ctx, EVP_sha256());
+    sign->ctx = ctx;
+    sign->tree = 1;
+}
+
+static void sign_add_chunk(struct tndb_sign *sign, const unsigned char *md)
+{
+    if (sign->nchunks == sign->chunks_size) {
+        sign->chunks_size = sign->chunks_size ? sign->chunks_size * 2 : 64;
+        sign->chunks = n_realloc(sign->chunks,
+                                 sign->chunks_size * TNDB_SIGN_TREE_MDSIZE);
+    }
+
+    memcpy(sign->chunks + sign->nchunks * TNDB_SIGN_TREE_MDSIZE, md,
+           TNDB_SIGN_TREE_MDSIZE);
+    sign->nchunks++;
+}
+
+/* ends current chunk, if any */
+void tndb_sign_region(struct tndb_sign *sign)
+{
+    unsigned char md[EVP_MAX_MD_SIZE];
+    unsigned n;
+
+    n_assert(sign->tree);
+    if (sign->clen == 0)
+        return;
+
+    EVP_DigestFinal(sign->ctx, md, &n);
+    n_assert(n == TNDB_SIGN_TREE_MDSIZE);
+    sign_add_chunk(sign, md);
+
+    EVP_DigestInit(sign->ctx, EVP_sha256());
+    sign->clen = 0;
+}
+
+/* adds chunks digested by tndb_sign_chunk() */
+void tndb_sign_add_chunks(struct tndb_sign *sign, const unsigned char *mds,
+                          uint32_t n)
+{
+    uint32_t i;
+
+    n_assert(sign->tree && sign->clen == 0);
+    for (i=0; i < n; i++)
+        sign_add_chunk(sign, mds + i * TNDB_SIGN_TREE_MDSIZE);
+}
+
+/* digests a single chunk, safe to be called by many threads at once */
+int tndb_sign_chunk(const void *buf, unsigned int size, unsigned char *md)
+{
+    unsigned n = 0;
+
+    return EVP_Digest(buf, size, md, &n, EVP_sha256(), NULL) &&
+        n == TNDB_SIGN_TREE_MDSIZE;
+}
+
 void tndb_sign_update(struct tndb_sign *sign, const void *buf, unsigned int size)
 {
+    const unsigned char *p = buf;
+
     n_assert(sign->ctx);
-    EVP_DigestUpdate(sign->ctx, buf, size);
-    //printf(" >> UPDATE %d (%s)\n", size, tndb_debug_bin2hex_s(buf, size));
+    if (!sign->tree) {
+        EVP_DigestUpdate(sign->ctx, buf, size);
+        //printf(" >> UPDATE %d (%s)\n", size, tndb_debug_bin2hex_s(buf, size));
+        return;
+    }
+
+    while (size > 0) {
+        unsigned int n = TNDB_SIGN_CHUNK - sign->clen;
+
+        if (n > size)
+            n = size;
+
+        EVP_DigestUpdate(sign->ctx, p, n);
+        sign->clen += n;
+        p += n;
+        size -= n;
+
+        if (sign->clen == TNDB_SIGN_CHUNK)
+            tndb_sign_region(sign);
+    }
 }
 
 
@@ -117,6 +418,20 @@ void tndb_sign_final(struct tndb_sign *sign)
     unsigned n;
 
     //printf("%p %p >> FINAL\n", sign, sign->ctx);
+    if (sign->tree) {
+        tndb_sign_region(sign);
+        EVP_Digest(sign->chunks, sign->nchunks * TNDB_SIGN_TREE_MDSIZE,
+                   sign->tmd, &n, EVP_sha256(), NULL);
+
+        free(sign->chunks);
+        sign->chunks = NULL;
+        sign->nchunks = sign->chunks_size = 0;
+
+        EVP_MD_CTX_destroy((EVP_MD_CTX *)sign->ctx);
+        sign->ctx = NULL;
+        return;
+    }
+
     EVP_DigestFinal(sign->ctx, buf, &n);
 
     if (n > (int)sizeof(sign->md))
@@ -139,6 +454,10 @@ int tndb_sign_store_sizeof(struct tndb_sign *sign, uint32_t flags)
     if (flags & TNDB_SIGN_DIGEST)
         size += sizeof(uint8_t) + strlen("md") +
             sizeof(uint16_t) + sizeof(sign->md);
+
+    if (flags & TNDB_SIGN_TREE)
+        size += sizeof(uint8_t) + strlen("tree") +
+            sizeof(uint16_t) + sizeof(sign->tmd);
     return size;
 }
 
@@ -173,35 +492,6 @@ int store_sig(tn_stream *st, const char *name, void *sig, int size)
     return stsize;
 }
 
-static
-int restore_sig(tn_stream *st, char *name, int namesize, void *sig, unsigned int size)
-{
-    uint16_t ssize;
-    uint8_t  nsize;
-    int stsize = 0;
-
-    if (!n_stream_read_uint8(st, &nsize))
-        return 0;
-
-    n_assert(namesize > nsize);
-    if (n_stream_read(st, name, nsize) != nsize)
-        return 0;
-    name[nsize] = '\0';
-
-    stsize += sizeof(nsize) + nsize;
-
-    if (!n_stream_read_uint16(st, &ssize))
-        return 0;
-
-    n_assert(size > ssize);
-    if (n_stream_read(st, sig, ssize) != ssize)
-        return 0;
-
-    stsize += sizeof(ssize) + ssize;
-    return stsize;
-}
-
-
 int tndb_sign_store(struct tndb_sign *sign, tn_stream *st, uint32_t flags)
 {
     int size, stsize;
@@ -222,65 +512,365 @@ int tndb_sign_store(struct tndb_sign *sign, tn_stream *st, uint32_t flags)
         stsize += n;
     }
 
+    if (flags & TNDB_SIGN_TREE) {
+        int n;
+        if ((n = store_sig(st, "tree", sign->tmd, sizeof(sign->tmd))) == 0)
+            return 0;
+        stsize += n;
+    }
+
     n_assert((int)sizeof(uint16_t) + stsize == size);
     return 1;
 }
 
 
-int tndb_sign_restore(tn_stream *st, struct tndb_sign *sign, uint32_t flags)
+/* decodes signatures stored by tndb_sign_store(), buf holds size bytes
+   following tndb_sign size */
+static
+int tndb_sign_decode(struct tndb_sign *sign, const unsigned char *buf,
+                     int size, uint32_t flags)
 {
-    int rc = 1, size;
     uint16_t size16;
-    char name[32], sig[UINT16_MAX];
+    int n = 0;
 
-    n_assert(n_stream_tell(st) == TNDBSIGN_OFFSET);
-    if (!n_stream_read_uint16(st, &size16))
-        return 0;
+    while (n < size) {
+        const unsigned char *name;
+        int nlen = buf[n++], len;
 
-    size16 -= sizeof(size16);
-    size = size16;
+        if (n + nlen + (int)sizeof(size16) > size)
+            goto l_einval;
 
-    while (size > 0) {
-        int n;
-        n = restore_sig(st, name, sizeof(name), sig, sizeof(sig));
-        if (n == 0) {
-            rc = 0;
-            break;
-        }
-        size -= n;
-        if (size < 0 || size > size16) {  /* overrun */
-            rc = 0;
-            errno = EINVAL;
-            break;
-        }
-        DBGF("%s, length=%d\n", name, n);
-        if (strcmp(name, "md") == 0) {
-            n_assert (flags & TNDB_SIGN_DIGEST);
-            if (!memcpy(sign->md, sig, sizeof(sign->md))) {
-                rc = 0;
-                break;
-            }
+        name = buf + n;
+        n += nlen;
+
+        memcpy(&size16, buf + n, sizeof(size16));
+        len = n_ntoh16(size16);
+        n += sizeof(size16);
+
+        if (n + len > size)
+            goto l_einval;
+
+        DBGF("%.*s, length=%d\n", nlen, name, len);
+        if (nlen == 2 && memcmp(name, "md", 2) == 0) {
+            if ((flags & TNDB_SIGN_DIGEST) == 0 || len != sizeof(sign->md))
+                goto l_einval;
+
+            memcpy(sign->md, buf + n, sizeof(sign->md));
+
+        } else if (nlen == 4 && memcmp(name, "tree", 4) == 0) {
+            if ((flags & TNDB_SIGN_TREE) == 0 || len != sizeof(sign->tmd))
+                goto l_einval;
+
+            memcpy(sign->tmd, buf + n, sizeof(sign->tmd));
         }
+        n += len;
     }
-    return rc;
+
+    return 1;
+
+ l_einval:
+    errno = EINVAL;
+    return 0;
+}
+
+
+/*
+  Format 1.1 header extension is stored just after doffs in the same way
+  as signatures: [size(2bytes)] followed by [name size(1byte)]name[size(2bytes)]data
+  entries. Entries unknown to reader are skipped.
+*/
+#define TNDB_HDREXT_MAX  1024
+
+static
+int ext_pack(unsigned char *buf, int n, const char *name, const void *data,
+             int size)
+{
+    uint16_t size16;
+    int len = strlen(name);
+
+    n_assert(len < UINT8_MAX);
+    n_assert(n + 1 + len + 2 + size <= TNDB_HDREXT_MAX);
+
+    buf[n++] = len;
+    memcpy(buf + n, name, len);
+    n += len;
+
+    size16 = n_hton16(size);
+    memcpy(buf + n, &size16, sizeof(size16));
+    n += sizeof(size16);
+
+    memcpy(buf + n, data, size);
+    return n + size;
+}
+
+/* packs header extension into buf (TNDB_HDREXT_MAX bytes), returns its size */
+static
+int tndb_hdr_ext_pack(const struct tndb_hdr *hdr, unsigned char *buf)
+{
+    uint16_t size16;
+    uint32_t v;
+    int n = sizeof(size16);
+
+    v = n_hton32(hdr->xflags);
+    n = ext_pack(buf, n, "xflags", &v, sizeof(v));
+
+    if (hdr->xflags & TNDB_BLOCKZ) {
+        uint32_t blkz[2];
+
+        blkz[0] = n_hton32(hdr->blksize);
+        blkz[1] = n_hton32(hdr->nblocks);
+        n = ext_pack(buf, n, "blkz", blkz, sizeof(blkz));
+    }
+
+    if (hdr->hashid != TNDB_HASH_DJB2)
+        n = ext_pack(buf, n, "hash", &hdr->hashid, sizeof(hdr->hashid));
+
+    if (hdr->xflags & TNDB_HTSCALE) {
+        v = n_hton32(hdr->htsize);
+        n = ext_pack(buf, n, "htsz", &v, sizeof(v));
+    }
+
+    if (hdr->xflags & TNDB_BLOOM) {
+        v = n_hton32(hdr->bloom_nblocks);
+        n = ext_pack(buf, n, "bloom", &v, sizeof(v));
+    }
+
+    if (hdr->xflags & TNDB_KEYIDX) {
+        v = n_hton32(hdr->kidx_nkeys);
+        n = ext_pack(buf, n, "kidx", &v, sizeof(v));
+    }
+
+    if (hdr->xflags & TNDB_SIGN_MERKLE) {
+        v = n_hton32(hdr->mrkl_nchunks);
+        n = ext_pack(buf, n, "mrkl", &v, sizeof(v));
+    }
+
+    if (hdr->xflags & TNDB_MPHF) {
+        uint32_t mph[3];
+
+        mph[0] = n_hton32(hdr->mph_seed);
+        mph[1] = n_hton32(hdr->mph_nbuckets);
+        mph[2] = n_hton32(hdr->mph_nkeys);
+        n = ext_pack(buf, n, "mph", mph, sizeof(mph));
+    }
+
+    size16 = n_hton16(n);
+    memcpy(buf, &size16, sizeof(size16));
+    return n;
 }
 
+/* decodes header extension entries, buf holds size bytes following its
+   size */
+static
+int tndb_hdr_ext_decode(struct tndb_hdr *hdr, const unsigned char *buf,
+                        int size)
+{
+    uint16_t size16;
+    int n = 0;
+
+    while (n < size) {
+        char name[UINT8_MAX + 1];
+        int  len = buf[n++];
+
+        if (n + len + (int)sizeof(size16) > size)
+            goto l_einval;
+
+        memcpy(name, buf + n, len);
+        name[len] = '\0';
+        n += len;
+
+        memcpy(&size16, buf + n, sizeof(size16));
+        len = n_ntoh16(size16);
+        n += sizeof(size16);
+
+        if (n + len > size)
+            goto l_einval;
+
+        DBGF("%s, length=%d\n", name, len);
+        if (strcmp(name, "xflags") == 0) {
+            uint32_t v;
+
+            if (len != sizeof(v))
+                goto l_einval;
+
+            memcpy(&v, buf + n, sizeof(v));
+            hdr->xflags = n_ntoh32(v) & TNDB_HDR_XFLAGS;
+
+        } else if (strcmp(name, "blkz") == 0) {
+            uint32_t blkz[2];
+
+            if (len != sizeof(blkz))
+                goto l_einval;
+
+            memcpy(blkz, buf + n, sizeof(blkz));
+            hdr->blksize = n_ntoh32(blkz[0]);
+            hdr->nblocks = n_ntoh32(blkz[1]);
+
+            if (hdr->blksize == 0 || hdr->blksize > TNDB_BLKZ_SIZE_MAX)
+                goto l_einval;
+
+        } else if (strcmp(name, "hash") == 0) {
+            if (len != sizeof(hdr->hashid))
+                goto l_einval;
+
+            hdr->hashid = buf[n];
+            if (hdr->hashid != TNDB_HASH_DJB2 && hdr->hashid != TNDB_HASH_WY64)
+                goto l_einval;
+
+        } else if (strcmp(name, "mph") == 0) {
+            uint32_t mph[3];
+
+            if (len != sizeof(mph))
+                goto l_einval;
+
+            memcpy(mph, buf + n, sizeof(mph));
+            hdr->mph_seed = n_ntoh32(mph[0]);
+            hdr->mph_nbuckets = n_ntoh32(mph[1]);
+            hdr->mph_nkeys = n_ntoh32(mph[2]);
+
+            if ((hdr->mph_nbuckets == 0) != (hdr->mph_nkeys == 0))
+                goto l_einval;
+
+        } else if (strcmp(name, "htsz") == 0) {
+            uint32_t v;
+
+            if (len != sizeof(v))
+                goto l_einval;
+
+            memcpy(&v, buf + n, sizeof(v));
+            hdr->htsize = n_ntoh32(v);
+
+            if (hdr->htsize == 0 || hdr->htsize > TNDB_HTSIZE_MAX ||
+                (hdr->htsize & (hdr->htsize - 1)) != 0)
+                goto l_einval;
+
+        } else if (strcmp(name, "bloom") == 0) {
+            uint32_t v;
+
+            if (len != sizeof(v))
+                goto l_einval;
+
+            memcpy(&v, buf + n, sizeof(v));
+            hdr->bloom_nblocks = n_ntoh32(v);
+
+            if (hdr->bloom_nblocks == 0 ||
+                hdr->bloom_nblocks > TNDB_BLOOM_NBLOCKS_MAX)
+                goto l_einval;
+
+        } else if (strcmp(name, "kidx") == 0) {
+            uint32_t v;
+
+            if (len != sizeof(v))
+                goto l_einval;
+
+            memcpy(&v, buf + n, sizeof(v));
+            hdr->kidx_nkeys = n_ntoh32(v);
+
+        } else if (strcmp(name, "mrkl") == 0) {
+            uint32_t v;
+
+            if (len != sizeof(v))
+                goto l_einval;
+
+            memcpy(&v, buf + n, sizeof(v));
+            hdr->mrkl_nchunks = n_ntoh32(v);
+
+            if (hdr->mrkl_nchunks > TNDB_MRKL_NCHUNKS_MAX)
+                goto l_einval;
+        }
+        n += len;
+    }
+
+    /* features unknown to us */
+    if (hdr->xflags & ~TNDB_HDR_XFLAGS_KNOWN)
+        goto l_einval;
+
+    if (((hdr->xflags & TNDB_HASH64) != 0) != (hdr->hashid == TNDB_HASH_WY64))
+        goto l_einval;
+
+    /* blocks are useless without their size */
+    if ((hdr->xflags & TNDB_BLOCKZ) && hdr->blksize == 0)
+        goto l_einval;
+
+    /* every distinct key has its slot */
+    if ((hdr->xflags & TNDB_MPHF) &&
+        (hdr->mph_nkeys > hdr->nrec || (hdr->nrec > 0 && hdr->mph_nkeys == 0)))
+        goto l_einval;
+
+    /* filter without its size or of db without hash table */
+    if ((hdr->xflags & TNDB_BLOOM) &&
+        (hdr->bloom_nblocks == 0 || (hdr->flags & TNDB_NOHASH)))
+        goto l_einval;
+
+    if ((hdr->xflags & TNDB_KEYIDX) &&
+        (hdr->kidx_nkeys > hdr->nrec || (hdr->nrec > 0 && hdr->kidx_nkeys == 0)))
+        goto l_einval;
+
+    /* chunks are signed by tree signature, blocks are not chunked */
+    if ((hdr->xflags & TNDB_SIGN_MERKLE) &&
+        ((hdr->flags & TNDB_SIGN_TREE) == 0 || (hdr->xflags & TNDB_BLOCKZ)))
+        goto l_einval;
+
+    if ((hdr->xflags & TNDB_HTSCALE) == 0)
+        hdr->htsize = TNDB_HTSIZE;
+    else if (hdr->htsize == 0)
+        goto l_einval;
+
+    return 1;
+
+ l_einval:
+    errno = EINVAL;
+    return 0;
+}
 
 void tndb_hdr_init(struct tndb_hdr *hdr, unsigned flags)
 {
     memset(hdr, 0, sizeof(*hdr));
-    hdr->flags |= flags;
+    hdr->flags = flags & 0xff;
+    hdr->xflags = flags & TNDB_HDR_XFLAGS & ~TNDB_HDR_XSIGN_TREE;
+    hdr->htsize = TNDB_HTSIZE; /* set by writer if TNDB_HTSCALE */
+
+    if (hdr->xflags & TNDB_SIGN_MERKLE)
+        hdr->flags |= TNDB_SIGN_TREE;
+
+    /* compressed blocks size is not known before the table is placed,
+       plain tree signature is used then */
+    if (hdr->xflags & TNDB_BLOCKZ)
+        hdr->xflags &= ~TNDB_SIGN_MERKLE;
+
+    /* the only signature computed then, format 1.1 at least */
+    if (hdr->flags & TNDB_SIGN_TREE) {
+        hdr->flags &= ~TNDB_SIGN_DIGEST;
+        hdr->xflags |= TNDB_HDR_XSIGN_TREE;
+    }
+
+    /* filter and key index are built of hash entries */
+    if (hdr->flags & TNDB_NOHASH)
+        hdr->xflags &= ~(TNDB_BLOOM | TNDB_KEYIDX);
+
+    if (flags & TNDB_HASH64)
+        hdr->hashid = TNDB_HASH_WY64;
+
+    /* keep the oldest format capable of features used */
+    if (hdr->hashid != TNDB_HASH_DJB2)
+        hdr->minor = 2;
+    else if (hdr->xflags)
+        hdr->minor = 1;
+    else
+        hdr->minor = 0;
 
     /* avoid format-truncation warn */
     char hdrbuf[12];
     int n  = n_snprintf(hdrbuf, sizeof(hdrbuf), "tndb%d.%d\n",
-                        TNDB_FILEFMT_MAJOR, TNDB_FILEFMT_MINOR);
+                        TNDB_FILEFMT_MAJOR, hdr->minor);
     n_assert(n == (int)sizeof(hdr->hdr));
 
     memcpy(hdr->hdr, hdrbuf, sizeof(hdr->hdr));
     DBGF("hdrbuf [%s] [%s]\n", hdrbuf, hdr->hdr);
 
-    if (flags & TNDB_SIGN_DIGEST)
+    if (hdr->flags & TNDB_SIGN_TREE)
+        tndb_sign_init_tree(&hdr->sign);
+    else if (hdr->flags & TNDB_SIGN_DIGEST)
         tndb_sign_init(&hdr->sign);
 }
 
@@ -327,6 +917,15 @@ int tndb_hdr_store_(struct tndb_hdr *hdr, tn_stream *st, int writeit)
     if (!hdr_write_uint32(hdr, st, hdr->doffs, writeit))
         nerr++;
 
+    if (hdr->minor > 0) {
+        unsigned char buf[TNDB_HDREXT_MAX];
+
+        size = tndb_hdr_ext_pack(hdr, buf);
+        if (writeit)
+            nerr += n_stream_write(st, buf, size) != size;
+        else
+            tndb_sign_update(&hdr->sign, buf, size);
+    }
 
     DBGF("nrec %u, doffs %u\n", hdr->nrec, hdr->doffs);
     return nerr == 0;
@@ -339,7 +938,17 @@ int tndb_hdr_store(struct tndb_hdr *hdr, tn_stream *st)
 
 int tndb_hdr_compute_digest(struct tndb_hdr *hdr)
 {
-    return tndb_hdr_store_(hdr, NULL, 0);
+    int rc;
+
+    if (hdr->sign.tree)         /* header is a region of its own */
+        tndb_sign_region(&hdr->sign);
+
+    rc = tndb_hdr_store_(hdr, NULL, 0);
+
+    if (hdr->sign.tree)
+        tndb_sign_region(&hdr->sign);
+
+    return rc;
 }
 
 
@@ -351,61 +960,126 @@ int tndb_hdr_store_sizeof(struct tndb_hdr *hdr)
     size += tndb_sign_store_sizeof(&hdr->sign, hdr->flags);
     size += sizeof(hdr->nrec) + sizeof(hdr->doffs) +
         sizeof(hdr->ts);
+
+    if (hdr->minor > 0) {
+        unsigned char buf[TNDB_HDREXT_MAX];
+        size += tndb_hdr_ext_pack(hdr, buf);
+    }
     return size;
 }
 
 
 
-int tndb_hdr_restore(struct tndb_hdr *hdr, tn_stream *st)
+/*
+  Decodes header from the first size bytes of file in buf.
+  Returns header size, 0 if it is not valid or -n if it does not fit in
+  buf, n bytes are needed at least then.
+*/
+int tndb_hdr_decode(struct tndb_hdr *hdr, const unsigned char *buf, int size)
 {
-    int nerr = 0, size;
+    uint16_t size16;
+    uint32_t v[3];
+    int      n, ssize, esize;
 
-    if (n_stream_seek(st, 0, SEEK_SET) == -1)
+    memset(hdr, 0, sizeof(*hdr));
+
+    n = TNDBSIGN_OFFSET + sizeof(size16);
+    if (size < n)
+        return -n;
+
+    memcpy(hdr->hdr, buf, sizeof(hdr->hdr));
+
+    /* "tndbM.m\n", newer minor versions are not readable */
+    if (memcmp(hdr->hdr, "tndb", 4) != 0 || hdr->hdr[5] != '.' ||
+        hdr->hdr[7] != '\n' ||
+        hdr->hdr[4] != '0' + TNDB_FILEFMT_MAJOR ||
+        hdr->hdr[6] < '0' || hdr->hdr[6] > '0' + TNDB_FILEFMT_MINOR)
+        goto l_einval;
+
+    hdr->minor = hdr->hdr[6] - '0';
+    hdr->flags = buf[sizeof(hdr->hdr)];
+
+    /* signatures, their size includes itself */
+    memcpy(&size16, buf + TNDBSIGN_OFFSET, sizeof(size16));
+    ssize = n_ntoh16(size16);
+    if (ssize < (int)sizeof(size16))
+        goto l_einval;
+
+    n = TNDBSIGN_OFFSET + ssize + sizeof(v);
+    if (size < n)
+        return -n;
+
+    if (!tndb_sign_decode(&hdr->sign, buf + TNDBSIGN_OFFSET + sizeof(size16),
+                          ssize - sizeof(size16), hdr->flags))
         return 0;
 
-    size = sizeof(hdr->hdr);
-    nerr += n_stream_read(st, hdr->hdr, size) != size;
+    memcpy(v, buf + TNDBSIGN_OFFSET + ssize, sizeof(v));
+    hdr->ts = n_ntoh32(v[0]);
+    hdr->nrec = n_ntoh32(v[1]);
+    hdr->doffs = n_ntoh32(v[2]);
 
-    if (nerr == 0 && !n_stream_read_uint8(st, &hdr->flags))
-        nerr++;
+    if (hdr->minor == 0) {
+        hdr->htsize = TNDB_HTSIZE;
+        goto l_end;
+    }
 
-    if (nerr == 0 && !tndb_sign_restore(st, &hdr->sign, hdr->flags))
-        nerr++;
+    /* extension, its size includes itself too */
+    if (size < n + (int)sizeof(size16))
+        return -(n + (int)sizeof(size16));
 
-    if (nerr == 0 && !n_stream_read_uint32(st, &hdr->ts))
-        nerr++;
+    memcpy(&size16, buf + n, sizeof(size16));
+    esize = n_ntoh16(size16);
+    if (esize < (int)sizeof(size16))
+        goto l_einval;
 
-    if (nerr == 0 && !n_stream_read_uint32(st, &hdr->nrec))
-        nerr++;
+    if (size < n + esize)
+        return -(n + esize);
 
-    if (nerr == 0 && !n_stream_read_uint32(st, &hdr->doffs))
-        nerr++;
+    if (!tndb_hdr_ext_decode(hdr, buf + n + sizeof(size16),
+                             esize - sizeof(size16)))
+        return 0;
 
-    DBGF("nrec %u, doffs %u, errs %d\n", hdr->nrec, hdr->doffs, nerr);
+    n += esize;
 
-    return nerr == 0;
+ l_end:
+    /* tree signature without its mark, see TNDB_HDR_XSIGN_TREE */
+    if (((hdr->flags & TNDB_SIGN_TREE) != 0) !=
+        ((hdr->xflags & TNDB_HDR_XSIGN_TREE) != 0))
+        goto l_einval;
+
+    DBGF("nrec %u, doffs %u, size %d\n", hdr->nrec, hdr->doffs, n);
+    return n;
+
+ l_einval:
+    errno = EINVAL;
+    return 0;
 }
 
-struct tndb_hent *tndb_hent_new(struct tndb *db, uint32_t val, uint32_t offs)
+struct tndb_whent *tndb_whent_new(struct tndb *db, uint32_t val, uint32_t offs)
 {
-    struct tndb_hent *h = NULL;
+    struct tndb_whent *h = NULL;
 
     n_assert(db);
     n_assert(db->na);
     h = db->na->na_malloc(db->na, sizeof(*h));
     h->val = val;
     h->offs = offs;
+    h->fp = 0;
+    h->hv2 = 0;
+    h->hb = 0;
+    h->key = NULL;
+    h->klen = 0;
 
     return h;
 }
 
-void tndb_hent_free(void *ptr)
+void tndb_whent_free(void *ptr)
 {
     ptr = ptr;                  /* do nothing, obstack is used */
 }
 
 
-int tndb_hent_cmp_store(const struct tndb_hent *h1, struct tndb_hent *h2)
+int tndb_whent_cmp_store(const struct tndb_whent *h1, struct tndb_whent *h2)
 {
     if (h1->val < h2->val)
         return -1;
@@ -423,18 +1097,6 @@ int tndb_hent_cmp_store(const struct tndb_hent *h1, struct tndb_hent *h2)
 }
 
 
-int tndb_hent_cmp(const struct tndb_hent *h1, struct tndb_hent *h2)
-{
-    if (h1->val < h2->val)
-        return -1;
-
-    if (h2->val < h1->val)
-        return 1;
-
-    return 0;
-}
-
-
 struct tndb *tndb_new(unsigned flags)
 {
     struct tndb *db;
@@ -443,6 +1105,7 @@ struct tndb *tndb_new(unsigned flags)
     db = n_calloc(1, sizeof(*db));
     db->st = NULL;
     db->path = NULL;
+    db->fd = -1;
 
     tndb_hdr_init(&db->hdr, flags);
 
@@ -459,12 +1122,127 @@ void tndb_free(struct tndb *db)
 {
     int i;
 
+    if (db->vrfy != NULL)       /* wait for background verification */
+        tndb_vrfy_free(db);
+
     for (i=0; i < TNDB_HTSIZE; i++)
         if (db->htt[i] != NULL) {
             n_array_free(db->htt[i]);
             db->htt[i] = NULL;
         }
 
+    if (db->hents != NULL) {
+        free(db->hents);
+        db->hents = NULL;
+    }
+
+    if (db->hfps != NULL) {
+        free(db->hfps);
+        db->hfps = NULL;
+    }
+
+    if (db->mphdisp != NULL) {
+        free(db->mphdisp);
+        db->mphdisp = NULL;
+    }
+
+    if (db->mphoffs != NULL) {
+        free(db->mphoffs);
+        db->mphoffs = NULL;
+    }
+
+    if (db->mphents != NULL) {
+        free(db->mphents);
+        db->mphents = NULL;
+    }
+
+    if (db->bloombuf != NULL) {
+        free(db->bloombuf);
+        db->bloombuf = NULL;
+    }
+    db->bloom = NULL;
+
+    if (db->itwin.buf != NULL) {
+        free(db->itwin.buf);
+        memset(&db->itwin, 0, sizeof(db->itwin));
+    }
+
+    if (db->mrkl != NULL) {
+        free(db->mrkl);
+        db->mrkl = NULL;
+    }
+
+    if (db->mrkl_ok != NULL) {
+        free(db->mrkl_ok);
+        db->mrkl_ok = NULL;
+    }
+
+    if (db->hdr.sign.chunks != NULL) { /* not finalized */
+        free(db->hdr.sign.chunks);
+        db->hdr.sign.chunks = NULL;
+    }
+
+    if (db->head != NULL) {
+        free(db->head);
+        db->head = NULL;
+        db->head_size = 0;
+    }
+
+    if (db->vcache != NULL) {
+        tndb_vcache_free(db->vcache);
+        db->vcache = NULL;
+    }
+
+    if (db->ordoffs != NULL) {
+        free(db->ordoffs);
+        db->ordoffs = NULL;
+    }
+
+    if (db->kidx != NULL) {
+        free(db->kidx);
+        db->kidx = NULL;
+    }
+
+    if (db->kidxents != NULL) {
+        free(db->kidxents);
+        db->kidxents = NULL;
+    }
+
+    if (db->wents != NULL) {
+        free(db->wents);
+        db->wents = NULL;
+    }
+
+    if (db->hidx != NULL) {
+        free(db->hidx);
+        db->hidx = NULL;
+    }
+
+    if (db->hloaded != NULL) {
+        free(db->hloaded);
+        db->hloaded = NULL;
+    }
+
+    if (db->blkoffs != NULL) {
+        free(db->blkoffs);
+        db->blkoffs = NULL;
+    }
+
+    if (db->blkbuf != NULL) {
+        free(db->blkbuf);
+        db->blkbuf = NULL;
+    }
+
+    if (db->map != NULL) {
+        if (db->map_anon)
+            free((void*)db->map);
+#ifdef HAVE_MMAP
+        else
+            munmap((void*)db->map, db->map_size);
+#endif
+        db->map = NULL;
+    }
+
     if (db->st != NULL) {
         n_stream_close(db->st);
         db->st = NULL;
@@ -479,6 +1257,12 @@ void tndb_free(struct tndb *db)
         n_alloc_free(db->na);
         db->na = NULL;
     }
+
+    if (db->lock) {
+        pthread_mutex_destroy(db->lock);
+        free(db->lock);
+        db->lock = NULL;
+    }
     free(db);
 }
 
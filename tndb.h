@@ -21,6 +21,7 @@
 
 #include <trurl/nstream.h>
 #include <trurl/narray.h>
+#include <trurl/nmalloc.h>
 
 #ifndef EXPORT
 # define EXPORT extern
@@ -29,27 +30,131 @@
 struct tndb;
 
 #define TNDB_SIGN_DIGEST  (1 << 0)
+#define TNDB_SIGN_TREE    (1 << 1)         /* sign chunks of db separately
+                                              with SHA-256, they are verified
+                                              in parallel; replaces
+                                              TNDB_SIGN_DIGEST; format 1.1 */
 
 #define TNDB_NOHASH       (1 << 7)         /* build db without hash table */
 #define TNDB_SIGNED       TNDB_SIGN_DIGEST /* build signed db */
 
+/* format 1.1+ features, such a db could not be read by older tndb */
+#define TNDB_FPRINT       (1 << 8)         /* store key length and fingerprint
+                                              in hash table, lookups of absent
+                                              keys do not touch data then */
+#define TNDB_BLOCKZ       (1 << 9)         /* compress data in independent
+                                              blocks, lookup inflates just one
+                                              of them; uncompressed file name
+                                              is expected */
+#define TNDB_MPHF         (1 << 10)        /* index keys with minimal perfect
+                                              hash function instead of hash
+                                              table, every lookup probes just
+                                              one record */
+#define TNDB_HASH64       (1 << 11)        /* hash keys with 64-bit hash
+                                              function, faster for long keys
+                                              and with fewer collisions;
+                                              format 1.2 */
+#define TNDB_HTSCALE      (1 << 12)        /* scale number of hash table
+                                              buckets to number of records
+                                              instead of fixed 256 ones */
+#define TNDB_BLOOM        (1 << 13)        /* store Bloom filter of keys,
+                                              most lookups of absent keys
+                                              are answered by it, without
+                                              loading hash table */
+#define TNDB_KEYIDX       (1 << 14)        /* store index of keys sorted in
+                                              byte order, for ordered and
+                                              prefix scans (tndb_kit_*) */
+#define TNDB_ORDIDX       (1 << 15)        /* store offsets of records in
+                                              file order, for tndb_get_nth()
+                                              and tndb_it_start_nth() */
+#define TNDB_SIGN_MERKLE  (1 << 16)        /* store digests of TNDB_SIGN_TREE
+                                              data chunks, only header and
+                                              index are verified before the
+                                              first lookup then, data chunks
+                                              on the first access; not
+                                              available with TNDB_BLOCKZ */
+
 /* creates new database */
 EXPORT struct tndb *tndb_creat(const char *name, int comprlevel, unsigned flags);
 
 EXPORT int tndb_put(struct tndb *db, const char *key, unsigned int klen,
 		    const void *val, unsigned int vlen);
 
-/* opens *existing* database */
+/* tndb_open_ex() flags */
+#define TNDB_O_MMAP       (1 << 0)         /* map uncompressed db into memory */
+#define TNDB_O_CONCURRENT (1 << 1)         /* allow lookups from many threads */
+#define TNDB_O_INFLATE    (1 << 2)         /* inflate compressed db into
+                                              memory once, on open */
+#define TNDB_O_INFLATE_CACHE (1 << 3)      /* inflate compressed db into
+                                              private cache file, reused by
+                                              next opens of unchanged db */
+
+/*
+  opens *existing* database
+  TNDB_O_CONCURRENT handle could be used by many threads at once, all of
+  the lookup functions and iterators are safe then, except of
+  tndb_it_get_begin()/tndb_it_get_end() and tndb_tn_stream() users
+*/
 EXPORT struct tndb *tndb_open(const char *path);
 EXPORT struct tndb *tndb_dopen(int fd, const char *path);
+EXPORT struct tndb *tndb_open_ex(const char *path, unsigned flags);
+EXPORT struct tndb *tndb_dopen_ex(int fd, const char *path, unsigned flags);
 
 EXPORT int tndb_close(struct tndb *db);
 
+/*
+  sets directory of TNDB_O_INFLATE_CACHE files, $XDG_CACHE_HOME/tndb or
+  ~/.cache/tndb is used by default
+*/
+EXPORT int tndb_set_cachedir(const char *dir);
+
 /* unlinks && _closes_ db */
 EXPORT int tndb_unlink(struct tndb *db);
 
 EXPORT int tndb_verify(struct tndb *db);
 
+/*
+  Cache of verified databases, tndb_verify() does not digest again a file
+  found there. Key identifies db's path and file's content (device,
+  inode, size, mtime, ctime and signature), so any change of file
+  invalidates it.
+  By default entries are kept in "verified" subdirectory of cache
+  directory (see tndb_set_cachedir()). Lookup costs fstat(2) of db,
+  resolving of its path and one access(2) call, it creates nothing.
+  Custom cache (e.g. xattrs of db files) could be set, NULL callbacks
+  disable caching, NULL vc restores the default one.
+*/
+struct tndb_verify_cache {
+    int  (*lookup)(const char *path, const char *key, void *arg); /* 1 if cached */
+    void (*store)(const char *path, const char *key, void *arg);
+    void *arg;
+};
+
+EXPORT void tndb_set_verify_cache(const struct tndb_verify_cache *vc);
+
+/* tndb_verify_async() flags */
+#define TNDB_VA_READ  (1 << 0)  /* serve lookups while db is verified */
+
+/*
+  Verifies signed db on a helper thread, which reopens the file by path.
+  Lookups made before verification is done wait for it unless
+  TNDB_VA_READ is set, all lookups of db which failed verification fail.
+  done, if not NULL, is called from the helper thread with the result,
+  it must not close db; tndb_close() waits for verification to finish.
+  Returns 1 if verification is started or db is verified already (done
+  is called at once then), 0 on error.
+*/
+EXPORT int tndb_verify_async(struct tndb *db, unsigned flags,
+                             void (*done)(struct tndb *db, int ok, void *arg),
+                             void *arg);
+
+/* returns 1 if db is verified, 0 if verification failed, -1 if not done */
+EXPORT int tndb_verify_poll(struct tndb *db);
+
+/* waits for tndb_verify_async() and returns its result; verifies db as
+   tndb_verify() does if verification is not started */
+EXPORT int tndb_verify_wait(struct tndb *db);
+
 EXPORT struct tndb *tndb_ref(struct tndb *db);
 EXPORT tn_stream *tndb_tn_stream(const struct tndb *db);
 EXPORT const char *tndb_path(const struct tndb *db);
@@ -72,9 +177,51 @@ EXPORT size_t tndb_get_all(struct tndb *db, const void *key, size_t klen,
 EXPORT int tndb_get_str(struct tndb *db, const char *key,
 			unsigned char *val, unsigned int valsize);
 
+/**
+* Enables cache of values returned by tndb_get(), tndb_get_all() and
+* tndb_get_str() of up to size bytes, repeated lookups of cached keys do not
+* touch db then; the least recently used values are evicted first.
+* Cache is owned by db handle and shared by its threads, it should be set
+* up before handle is used by them; 0 size disables it.
+* Returns 0 if db is not opened for reading.
+*/
+EXPORT int tndb_set_vcache(struct tndb *db, size_t size);
+
 EXPORT int tndb_get_voff(struct tndb *db, const void *key, unsigned int aklen,
 			 uint32_t *voffs, unsigned int *vlen);
 
+/**
+* Zero-copy lookup, available for databases opened with TNDB_O_MMAP or
+* TNDB_O_INFLATE only.
+* On success *val points to the value inside db's mapping, it is valid
+* until tndb_close().
+* Returns 1 if key is found, 0 if not and -1 if db is not mapped.
+*/
+EXPORT int tndb_get_ref(struct tndb *db, const void *key, unsigned int klen,
+                        const void **val, unsigned int *vlen);
+
+/**
+* Looks up n keys at once, records are probed in ascending file order
+* so neighbouring ones are read together.
+* voffs[i] and vlens[i] are set to value offset and length of keys[i] or
+* to 0 if the key is not found. If vals is not NULL, values are read
+* into dynamically allocated buffers (as tndb_get_all() does) which should
+* be freed by caller.
+* Returns number of keys found or -1 on error.
+*/
+EXPORT int tndb_mget(struct tndb *db, unsigned int n, const char **keys,
+                     const unsigned int *klens, uint32_t *voffs,
+                     unsigned int *vlens, void **vals);
+
+/**
+* Retrieves i-th record (counting from 0, in file order) of TNDB_ORDIDX db,
+* key is retrieved as by tndb_it_get_voff(), if key is not NULL.
+* Returns 1 if found, 0 if there is no such record or no ordinal index and
+* -1 on error.
+*/
+EXPORT int tndb_get_nth(struct tndb *db, uint32_t i, void *key,
+                        unsigned int *klen, uint32_t *voff, unsigned int *vlen);
+
 EXPORT int tndb_read(struct tndb *db, long offs, void *buf, unsigned int size);
 
 
@@ -92,6 +239,9 @@ struct tndb_it {
 
 EXPORT int tndb_it_start(struct tndb *db, struct tndb_it *it);
 
+/* starts at i-th record, TNDB_ORDIDX db only (unless i is 0) */
+EXPORT int tndb_it_start_nth(struct tndb *db, struct tndb_it *it, uint32_t i);
+
 /*
   key size must be at least TNDB_KEY_MAX + 1 bytes
   if key is NULL then keys are not retrieved
@@ -99,6 +249,17 @@ EXPORT int tndb_it_start(struct tndb *db, struct tndb_it *it);
 EXPORT int tndb_it_get(struct tndb_it *it, void *key, unsigned int *klen,
 		       void *val, unsigned int *vlen);
 
+/*
+  zero-copy variant of tndb_it_get(), *key and *val point to record in db's
+  mapping, valid until tndb_close(), or in iterators' read-ahead buffer,
+  valid until the next iterator call; they are not '\0' terminated.
+  Not available on unmapped TNDB_O_CONCURRENT db.
+  Returns 1 if record is retrieved, 0 at the end and -1 on error.
+*/
+EXPORT int tndb_it_get_ref(struct tndb_it *it, const void **key,
+                           unsigned int *klen, const void **val,
+                           unsigned int *vlen);
+
 /* same as tndb_it_get() but, *val is realloced() if needed */
 EXPORT int tndb_it_rget(struct tndb_it *it, void *key, unsigned int *klen,
 	                void **val, unsigned int *vlen);
@@ -106,14 +267,90 @@ EXPORT int tndb_it_rget(struct tndb_it *it, void *key, unsigned int *klen,
 EXPORT int tndb_it_get_voff(struct tndb_it *it, void *key, unsigned int *klen,
                 	    uint32_t *voff, unsigned int *vlen);
 
-/* for reading directly from db's stream */
+/*
+  Parallel scan: tndb_split() splits db into at most n parts of about the
+  same size, at record boundaries, and returns their iterators in parts
+  (n entries). Parts could be read by different threads of
+  TNDB_O_CONCURRENT db, each by one of them at a time; views returned by
+  tndb_part_get_ref() are valid until the next call on that part. db
+  must not be closed before its parts are freed.
+  Returns number of parts (0 for empty db) or -1 on error.
+*/
+struct tndb_part;
+
+EXPORT int tndb_split(struct tndb *db, unsigned int n, struct tndb_part **parts);
+
+EXPORT int tndb_part_get_voff(struct tndb_part *part, void *key,
+                              unsigned int *klen, uint32_t *voff,
+                              unsigned int *vlen);
+EXPORT int tndb_part_get(struct tndb_part *part, void *key, unsigned int *klen,
+                         void *val, unsigned int *vlen);
+EXPORT int tndb_part_get_ref(struct tndb_part *part, const void **key,
+                             unsigned int *klen, const void **val,
+                             unsigned int *vlen);
+EXPORT void tndb_part_free(struct tndb_part *part);
+
+/* for reading directly from db's stream, not allowed on TNDB_BLOCKZ db */
 EXPORT int tndb_it_get_begin(struct tndb_it *it, void *key, unsigned int *klen,
             		     unsigned int *vlen);
 EXPORT int tndb_it_get_end(struct tndb_it *it);
 
 
+/*
+  ordered iterator of TNDB_KEYIDX db, keys are compared as byte strings,
+  the shorter one goes first if one is a prefix of another; duplicated
+  keys are visited once, with the last value
+*/
+struct tndb_kit {
+    struct tndb  *_db;
+    uint32_t     _pos;
+    uint32_t     _end;
+};
+
+/* all of keys; start functions return 0 if db has no key index */
+EXPORT int tndb_kit_start(struct tndb *db, struct tndb_kit *it);
+
+/* keys from the first one not less than key */
+EXPORT int tndb_kit_seek(struct tndb *db, struct tndb_kit *it,
+                         const void *key, unsigned int klen);
+
+/* keys starting with prefix */
+EXPORT int tndb_kit_prefix(struct tndb *db, struct tndb_kit *it,
+                           const void *prefix, unsigned int plen);
+
+/*
+  key size must be at least TNDB_KEY_MAX + 1 bytes, if key is NULL then
+  keys are not retrieved
+  Returns 1 if record is retrieved, 0 at the end and -1 on error.
+*/
+EXPORT int tndb_kit_get_voff(struct tndb_kit *it, void *key, unsigned int *klen,
+                             uint32_t *voff, unsigned int *vlen);
+
+/* same as tndb_it_get() */
+EXPORT int tndb_kit_get(struct tndb_kit *it, void *key, unsigned int *klen,
+                        void *val, unsigned int *vlen);
+
 EXPORT tn_array *tndb_keys(struct tndb *db);
 
+/* keys of all records, in file order or sorted as in tndb_kit_* */
+struct tndb_key {
+    const char   *key;          /* '\0' terminated */
+    unsigned int klen;
+};
+
+struct tndb_keyset {
+    unsigned int    nkeys;
+    struct tndb_key *keys;
+    tn_alloc        *_na;       /* keys' arena */
+};
+
+#define TNDB_KEYSET_SORTED (1 << 0)
+
+/* same as tndb_keys() but keys are stored in one arena, freed at once
+   by tndb_keyset_free() */
+EXPORT struct tndb_keyset *tndb_keyset(struct tndb *db, unsigned flags);
+EXPORT void tndb_keyset_free(struct tndb_keyset *ks);
+
 /* number of records */
 EXPORT uint32_t tndb_size(const struct tndb *db);
 
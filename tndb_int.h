@@ -2,8 +2,10 @@
 #define TNDB_INTERNAL_H
 
 #include <limits.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 
 /* FreeBSD does not provide PATH_MAX (syslimits.h is not for user) */
 #ifndef PATH_MAX
@@ -19,21 +21,53 @@
 #include <trurl/nmalloc.h>
 
 #define TNDB_FILEFMT_MAJOR     1
-#define TNDB_FILEFMT_MINOR     0
-
+#define TNDB_FILEFMT_MINOR     2 /* the newest one, older versions are still
+                                    created unless newer features are used */
 
 uint32_t tndb_hash(const void *d, register uint8_t size);
+uint32_t tndb_fprint(const void *d, uint8_t size);
+uint64_t tndb_hash64(const void *d, unsigned int size);
+
+/* hash functions ids */
+#define TNDB_HASH_DJB2    0     /* tndb_hash() and tndb_fprint() */
+#define TNDB_HASH_WY64    1     /* tndb_hash64() */
 
 #define TNDBSIGN_OFFSET       9 /* hdr[8] + sizeof(flags) */
+#define TNDB_SIGN_ANY         (TNDB_SIGN_DIGEST | TNDB_SIGN_TREE)
+#define TNDB_SIGN_CHUNK       (1024 * 1024)
+#define TNDB_SIGN_TREE_MDSIZE 32 /* sha256 */
+#define TNDB_MRKL_NCHUNKS_MAX (UINT32_MAX / TNDB_SIGN_CHUNK + 1)
+
+/*
+  TNDB_SIGN_MERKLE table of mrkl_nchunks data chunks' digests is stored
+  after TNDB_ORDIDX index. It is signed as a part of index, so it is
+  verified together with it.
+*/
+
 struct tndb_sign {
     void           *ctx;
     unsigned char  md[20];      /* sha */
+    unsigned char  tmd[TNDB_SIGN_TREE_MDSIZE]; /* TNDB_SIGN_TREE root */
+
+    /* TNDB_SIGN_TREE computation */
+    int            tree;
+    uint32_t       clen;        /* length of current chunk */
+    unsigned char  *chunks;     /* digests of the previous ones */
+    uint32_t       nchunks;
+    uint32_t       chunks_size;
 };
 
 void tndb_sign_init(struct tndb_sign *sign);
+void tndb_sign_init_tree(struct tndb_sign *sign);
 void tndb_sign_update(struct tndb_sign *sign, const void *buf, unsigned int size);
 void tndb_sign_update_int32(struct tndb_sign *sign, uint32_t v);
 void tndb_sign_final(struct tndb_sign *sign);
+
+/* TNDB_SIGN_TREE only */
+void tndb_sign_region(struct tndb_sign *sign);
+void tndb_sign_add_chunks(struct tndb_sign *sign, const unsigned char *mds,
+                          uint32_t n);
+int tndb_sign_chunk(const void *buf, unsigned int size, unsigned char *md);
 int  tndb_sign_store(struct tndb_sign *sign, tn_stream *st, uint32_t flags);
 
 
@@ -44,13 +78,53 @@ struct tndb_hdr {
     uint32_t           ts;          /*  */
     uint32_t           nrec;        /* number of records */
     uint32_t           doffs;       /* offset of first data record */
+
+    /* format 1.1+ header extension */
+    uint8_t            minor;       /* format minor version */
+    uint32_t           xflags;      /* creation flags which do not fit
+                                       into flags, i.e. >= (1 << 8) */
+    uint32_t           blksize;     /* TNDB_BLOCKZ: uncompressed block size */
+    uint32_t           nblocks;     /*   and number of blocks */
+    uint32_t           mph_seed;    /* TNDB_MPHF: hash seed, */
+    uint32_t           mph_nbuckets;/*   number of buckets */
+    uint32_t           mph_nkeys;   /*   and of distinct keys (slots) */
+    uint8_t            hashid;      /* TNDB_HASH_* */
+    uint32_t           htsize;      /* number of hash table buckets,
+                                       power of 2 (TNDB_HTSCALE) */
+    uint32_t           bloom_nblocks; /* TNDB_BLOOM filter size */
+    uint32_t           kidx_nkeys;  /* TNDB_KEYIDX: number of distinct keys */
+    uint32_t           mrkl_nchunks; /* TNDB_SIGN_MERKLE: number of data
+                                        chunks */
+};
+
+#define TNDB_HDR_XFLAGS   (~(uint32_t)0xff)
+
+/* TNDB_SIGN_TREE mark in extension; readers not aware of tree signature
+   refuse such a db instead of reading it as unsigned one */
+#define TNDB_HDR_XSIGN_TREE ((uint32_t)1 << 31)
+
+#define TNDB_HDR_XFLAGS_KNOWN (TNDB_FPRINT | TNDB_BLOCKZ | TNDB_MPHF | \
+                               TNDB_HASH64 | TNDB_HTSCALE | TNDB_BLOOM | \
+                               TNDB_KEYIDX | TNDB_ORDIDX | TNDB_SIGN_MERKLE | \
+                               TNDB_HDR_XSIGN_TREE)
+
+/* key hashes, see tndb_key_hash() */
+struct tndb_khash {
+    uint32_t hv;                /* stored in hash table entries */
+    uint32_t hv2;               /* secondary one, for fingerprints,
+                                   TNDB_MPHF and TNDB_BLOOM, computed
+                                   if needed only */
+    uint32_t hb;                /* bucket selector */
 };
 
+void tndb_key_hash(const struct tndb_hdr *hdr, const void *key, uint8_t klen,
+                   struct tndb_khash *kh);
+
 void tndb_hdr_init(struct tndb_hdr *hdr, unsigned flags);
 int tndb_hdr_store(struct tndb_hdr *hdr, tn_stream *st);
 int tndb_hdr_compute_digest(struct tndb_hdr *hdr);
 int tndb_hdr_store_sizeof(struct tndb_hdr *hdr);
-int tndb_hdr_restore(struct tndb_hdr *hdr, tn_stream *st);
+int tndb_hdr_decode(struct tndb_hdr *hdr, const unsigned char *buf, int size);
 
 #define tndb_hdr_upsign(hdr, buf, size)                \
       do { if (hdr->flags & TNDBHDR_SIGN)              \
@@ -63,20 +137,106 @@ struct tndb_hent {
     uint32_t offs;              /* offset in file */
 };
 
+/* hash entry of db being created */
+struct tndb_whent {
+    uint32_t val;
+    uint32_t offs;
+    uint32_t fp;                /* [klen(1byte)][fingerprint(3bytes)],
+                                   TNDB_FPRINT only */
+    uint32_t hv2;               /* secondary hash */
+    uint32_t hb;                /* bucket selector, bucket once laid out */
+    char     *key;              /* TNDB_KEYIDX only */
+    uint8_t  klen;
+};
+
+/* size of stored hash entry: val, offs and, optionally, fp */
+#define TNDB_HENT_STORE_SIZE(hdr) \
+    ((((hdr)->xflags & TNDB_FPRINT) ? 3 : 2) * sizeof(uint32_t))
+
+#define TNDB_KH_FP(kh, klen) \
+    (((uint32_t)(klen) << 24) | ((kh)->hv2 & 0xffffff))
+
 struct tndb;
 
-struct tndb_hent *tndb_hent_new(struct tndb *db, uint32_t val, uint32_t offs);
-void tndb_hent_free(void *ptr);
-int tndb_hent_cmp(const struct tndb_hent *h1, struct tndb_hent *h2);
-int tndb_hent_cmp_store(const struct tndb_hent *h1, struct tndb_hent *h2);
+struct tndb_whent *tndb_whent_new(struct tndb *db, uint32_t val, uint32_t offs);
+void tndb_whent_free(void *ptr);
+int tndb_whent_cmp_store(const struct tndb_whent *h1, struct tndb_whent *h2);
+
+/* TNDB_BLOCKZ data is stored as nblocks zlib compressed blocks of blksize
+   (the last one could be shorter) bytes, preceded by table of (nblocks + 1)
+   block offsets. Record offsets are offsets in uncompressed data as usual. */
+#define TNDB_BLKZ_SIZE      (64 * 1024)
+#define TNDB_BLKZ_SIZE_MAX  (16 * 1024 * 1024)
+
+/*
+  TNDB_MPHF index is CHD-like minimal perfect hash: key hashed by
+  tndb_mph_hash() falls into bucket h[0] % nbuckets, its slot is computed
+  from h[1], h[2] and the bucket's displacement. Index is stored as
+  displacements of nbuckets followed by nkeys slots, [offs] or [offs, fp]
+  (TNDB_FPRINT) each.
+*/
+void tndb_mph_hash(uint32_t hv, uint32_t hv2, uint32_t seed, uint32_t h[3]);
+
+static inline uint32_t tndb_mph_slot(const uint32_t h[3], uint32_t disp,
+                                     uint32_t nkeys)
+{
+    uint64_t d0 = disp / nkeys, d1 = disp % nkeys;
+    return (uint32_t)((h[1] + d0 * h[2] + d1) % nkeys);
+}
+
+/*
+  TNDB_BLOOM filter is blocked Bloom filter of bloom_nblocks 512-bit
+  blocks, every key sets TNDB_BLOOM_K bits of one block. It is stored
+  between hash table and TNDB_BLOCKZ block offsets table (or data).
+*/
+#define TNDB_BLOOM_BLKSIZE  64
+#define TNDB_BLOOM_BITS     10           /* bits per key, ~1% false positives */
+#define TNDB_BLOOM_K        7
+#define TNDB_BLOOM_NBLOCKS_MAX (1 << 24)
+
+/*
+  TNDB_KEYIDX index is array of kidx_nkeys record offsets sorted by
+  tndb_key_cmp() order of their keys, stored after TNDB_BLOOM filter.
+  TNDB_ORDIDX one, of nrec offsets in file order, follows it.
+*/
+static inline int tndb_key_cmp(const void *k1, unsigned int klen1,
+                               const void *k2, unsigned int klen2)
+{
+    int cmp = memcmp(k1, k2, klen1 < klen2 ? klen1 : klen2);
+
+    if (cmp == 0 && klen1 != klen2)
+        cmp = klen1 < klen2 ? -1 : 1;
+
+    return cmp;
+}
+
+void tndb_bloom_add(unsigned char *bloom, uint32_t nblocks,
+                    uint32_t hv, uint32_t hv2);
+int tndb_bloom_test(const unsigned char *bloom, uint32_t nblocks,
+                    uint32_t hv, uint32_t hv2);
+
+#define TNDB_HTSIZE       256          /* default number of buckets */
+#define TNDB_HTSIZE_MAX   (1 << 24)
+#define TNDB_HTLOAD       4            /* TNDB_HTSCALE: average bucket size */
+#define TNDB_HTBYTESIZE(hdr) ((hdr)->htsize * sizeof(uint32_t))
+
+/* read-ahead window of sequential reads */
+struct tndb_win {
+    unsigned char *buf;
+    uint32_t      offs;
+    unsigned int  len;
+    unsigned int  size;
+};
 
-#define TNDB_HTSIZE       256
-#define TNDB_HTBYTESIZE   (TNDB_HTSIZE * sizeof(uint32_t))
+struct tndb_vcache;
+struct tndb_vrfy;
 
 #define TNDB_R_MODE_R      (1 << 0)
 #define TNDB_R_MODE_W      (1 << 1)
-#define TNDB_R_HTT_LOADED  (1 << 2)
+#define TNDB_R_HTT_LOADED  (1 << 2) /* buckets layout, not the buckets */
 #define TNDB_R_SIGN_VRFIED (1 << 3)
+#define TNDB_R_BLOOM_LOADED (1 << 4)
+#define TNDB_R_KIDX_LOADED (1 << 5)
 
 #define TNDB_R_UNLINKED    (1 << 10)
 struct tndb {
@@ -92,7 +252,64 @@ struct tndb {
     } offs;
 
     tn_array                 *htt[TNDB_HTSIZE];  /* arary of tn_array ptr of
-                                                    tndb_hent */
+                                                    tndb_whent, rw mode only */
+    struct tndb_whent        **wents;  /* all of them sorted by bucket */
+    uint32_t                 nwents;
+
+    /* loaded hash table, entries of bucket i are
+       hents[hidx[i]] ... hents[hidx[i + 1] - 1] sorted by val,
+       buckets are loaded on demand */
+    struct tndb_hent         *hents;
+    uint32_t                 *hfps;    /* hents' or TNDB_MPHF slots'
+                                          fingerprints (TNDB_FPRINT) */
+    uint32_t                 *hidx;    /* hdr.htsize + 1 */
+    uint8_t                  *hloaded; /* hdr.htsize */
+
+    /* TNDB_MPHF */
+    uint32_t                 *mphdisp;   /* buckets displacements */
+    uint32_t                 *mphoffs;   /* slots, r mode only */
+    struct tndb_whent        **mphents;  /*   and rw mode ones */
+
+    /* TNDB_BLOOM */
+    const unsigned char      *bloom;     /* filter, in mapping or bloombuf */
+    unsigned char            *bloombuf;
+
+    /* TNDB_KEYIDX */
+    uint32_t                 *kidx;      /* record offsets, r mode only */
+    struct tndb_whent        **kidxents; /*   and rw mode ones */
+
+    /* TNDB_ORDIDX, rw mode only, read on demand otherwise */
+    uint32_t                 *ordoffs;   /* record offsets */
+    uint32_t                 ordsize;    /*   and allocated size */
+
+    /* TNDB_BLOCKZ */
+    int                      comprlevel; /* rw mode only */
+    uint32_t                 *blkoffs;   /* block offsets table */
+    unsigned char            *blkbuf;    /* the last inflated block */
+    uint32_t                 blkno;      /*   its number */
+    uint32_t                 blklen;     /*   and size, 0 if none */
+
+    /* TNDB_SIGN_MERKLE */
+    unsigned char            *mrkl;      /* data chunks' digests */
+    uint8_t                  *mrkl_ok;   /* verified chunks, NULL until
+                                            header and index are verified */
+
+    struct tndb_win          itwin;    /* iterators' read-ahead window */
+    struct tndb_vcache       *vcache;  /* values cache, NULL if disabled */
+    struct tndb_vrfy         *vrfy;    /* tndb_verify_async() job */
+
+    unsigned char            *head;    /* leading bytes of file read on open,
+                                          header and index if not too big */
+    uint32_t                 head_size;
+
+    const unsigned char      *map;     /* whole file mapping (TNDB_O_MMAP) */
+    size_t                   map_size;
+    int                      map_anon; /* map is malloc()ed inflated
+                                          copy (TNDB_O_INFLATE) */
+    int                      fd;       /* for positional reads
+                                          (TNDB_O_CONCURRENT), -1 otherwise */
+    pthread_mutex_t          *lock;    /* guards lazy loading and stream
+                                          reads (TNDB_O_CONCURRENT) */
     char                     errmsg[128];
     tn_alloc                 *na;
     int                      _refcnt;
@@ -101,6 +318,22 @@ struct tndb {
 struct tndb *tndb_new(unsigned flags);
 void tndb_free(struct tndb *db);
 
+static inline void tndb_lock(const struct tndb *db)
+{
+    if (db->lock)
+        pthread_mutex_lock(db->lock);
+}
+
+static inline void tndb_unlock(const struct tndb *db)
+{
+    if (db->lock)
+        pthread_mutex_unlock(db->lock);
+}
+
+/* runtime flags set lazily while db is shared by concurrent readers */
+#define tndb_rtflags(db)         __atomic_load_n(&(db)->rtflags, __ATOMIC_ACQUIRE)
+#define tndb_rtflags_set(db, f)  __atomic_or_fetch(&(db)->rtflags, (f), __ATOMIC_RELEASE)
+
 
 static inline
 int nn_stream_read_offs(tn_stream *st, void *buf, unsigned int size, uint32_t offs)
@@ -125,6 +358,23 @@ int nn_stream_read_uint32_offs(tn_stream *st, uint32_t *val, uint32_t offs)
 }
 
 int tndb_detect_stream_type(const char *path);
+int tndb_bin2hex(char *hex, int hex_size, const unsigned char *bin, int bin_size);
+
+/* cache.c */
+const char *tndb_cachedir(char *buf, int size);
+tn_stream *tndb_cache_inflated(tn_stream *st, int fd, const char *path);
+int tndb_verify_cached(const struct tndb *db);
+void tndb_verify_cache_put(const struct tndb *db);
+
+/* read.c */
+void tndb_vrfy_free(struct tndb *db);
+
+/* vcache.c */
+int tndb_vcache_get(struct tndb *db, const void *key, unsigned int klen,
+                    void *val, unsigned int valsize, void **valp);
+void tndb_vcache_put(struct tndb *db, const void *key, unsigned int klen,
+                     const void *val, unsigned int vlen);
+void tndb_vcache_free(struct tndb_vcache *vc);
 
 #ifndef ENABLE_TRACE
 # define ENABLE_TRACE 0
@@ -0,0 +1,246 @@
+/*
+  Copyright (C) 2026 Pawel A. Gajda <mis@pld-linux.org>
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Library General Public License, version 2
+  as published by the Free Software Foundation (see file COPYING for details).
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <trurl/nassert.h>
+#include <trurl/nmalloc.h>
+
+#include "compiler.h"
+#include "tndb_int.h"
+#include "tndb.h"
+
+/*
+  Per-handle cache of values returned by tndb_get() and tndb_get_all(),
+  keyed by key, so a hit skips both the record probe and the value read.
+  Size of the cache is bounded, the least recently used values are
+  evicted first. Absent keys are not cached.
+*/
+
+#define VCACHE_AVGSIZE  256     /* assumed average entry size */
+#define VCACHE_MAXENT   8       /* values bigger than size / 8 are not cached */
+
+struct vcent {
+    struct vcent  *hnext;       /* bucket chain */
+    struct vcent  *prev;        /* LRU list, the most recent first */
+    struct vcent  *next;
+    uint32_t      hv;
+    uint32_t      vlen;
+    uint8_t       klen;
+    unsigned char data[];       /* key followed by value */
+};
+
+struct tndb_vcache {
+    struct vcent  **buckets;
+    uint32_t      nbuckets;
+    struct vcent  *head;
+    struct vcent  *tail;
+    size_t        size;         /* bytes in use */
+    size_t        maxsize;
+};
+
+#define VCENT_SIZE(klen, vlen) (sizeof(struct vcent) + (klen) + (vlen))
+
+static struct tndb_vcache *vcache_new(size_t maxsize)
+{
+    struct tndb_vcache *vc;
+    uint32_t           n = 64;
+
+    while (n < maxsize / VCACHE_AVGSIZE && n < TNDB_HTSIZE_MAX)
+        n <<= 1;
+
+    vc = n_calloc(1, sizeof(*vc));
+    vc->buckets = n_calloc(n, sizeof(*vc->buckets));
+    vc->nbuckets = n;
+    vc->maxsize = maxsize;
+    return vc;
+}
+
+void tndb_vcache_free(struct tndb_vcache *vc)
+{
+    struct vcent *ent = vc->head;
+
+    while (ent) {
+        struct vcent *next = ent->next;
+        free(ent);
+        ent = next;
+    }
+
+    free(vc->buckets);
+    free(vc);
+}
+
+static void lru_unlink(struct tndb_vcache *vc, struct vcent *ent)
+{
+    if (ent->prev)
+        ent->prev->next = ent->next;
+    else
+        vc->head = ent->next;
+
+    if (ent->next)
+        ent->next->prev = ent->prev;
+    else
+        vc->tail = ent->prev;
+}
+
+static void lru_push(struct tndb_vcache *vc, struct vcent *ent)
+{
+    ent->prev = NULL;
+    ent->next = vc->head;
+
+    if (vc->head)
+        vc->head->prev = ent;
+    else
+        vc->tail = ent;
+
+    vc->head = ent;
+}
+
+static struct vcent **vcache_slot(struct tndb_vcache *vc, uint32_t hv,
+                                  const void *key, uint8_t klen)
+{
+    struct vcent **pp = &vc->buckets[hv & (vc->nbuckets - 1)];
+
+    for (; *pp; pp = &(*pp)->hnext) {
+        struct vcent *ent = *pp;
+
+        if (ent->hv == hv && ent->klen == klen &&
+            memcmp(ent->data, key, klen) == 0)
+            break;
+    }
+
+    return pp;
+}
+
+static void vcache_evict(struct tndb_vcache *vc)
+{
+    struct vcent *ent = vc->tail;
+    struct vcent **pp = vcache_slot(vc, ent->hv, ent->data, ent->klen);
+
+    n_assert(*pp == ent);
+    *pp = ent->hnext;
+
+    lru_unlink(vc, ent);
+    vc->size -= VCENT_SIZE(ent->klen, ent->vlen);
+    free(ent);
+}
+
+int tndb_set_vcache(struct tndb *db, size_t size)
+{
+    if ((db->rtflags & TNDB_R_MODE_R) == 0)
+        return 0;
+
+    tndb_lock(db);
+
+    if (db->vcache) {
+        tndb_vcache_free(db->vcache);
+        db->vcache = NULL;
+    }
+
+    if (size > 0)
+        db->vcache = vcache_new(size);
+
+    tndb_unlock(db);
+    return 1;
+}
+
+/*
+  Copies cached value of key into val if it is shorter than valsize or
+  into malloc()ed *valp if val is NULL.
+  Returns value length or -1 if key is not cached.
+*/
+int tndb_vcache_get(struct tndb *db, const void *key, unsigned int klen,
+                    void *val, unsigned int valsize, void **valp)
+{
+    struct tndb_vcache *vc;
+    struct vcent       *ent;
+    int                vlen = -1;
+
+    if (klen > UINT8_MAX)
+        return -1;
+
+    tndb_lock(db);              /* cache could be replaced meanwhile */
+    if ((vc = db->vcache) == NULL) {
+        tndb_unlock(db);
+        return -1;
+    }
+
+    if ((ent = *vcache_slot(vc, tndb_hash(key, klen), key, klen)) != NULL) {
+        const unsigned char *v = ent->data + ent->klen;
+
+        vlen = ent->vlen;
+        if (val == NULL) {
+            *valp = n_malloc(vlen + 1); /* extra byte for \0 */
+            memcpy(*valp, v, vlen);
+
+        } else if ((unsigned)vlen < valsize) {
+            memcpy(val, v, vlen);
+        }
+
+        if (ent != vc->head) {
+            lru_unlink(vc, ent);
+            lru_push(vc, ent);
+        }
+    }
+
+    tndb_unlock(db);
+    return vlen;
+}
+
+void tndb_vcache_put(struct tndb *db, const void *key, unsigned int klen,
+                     const void *val, unsigned int vlen)
+{
+    struct tndb_vcache *vc;
+    struct vcent       *ent, **pp;
+    size_t             size = VCENT_SIZE(klen, vlen);
+    uint32_t           hv;
+
+    if (klen > UINT8_MAX)
+        return;
+
+    hv = tndb_hash(key, klen);
+
+    tndb_lock(db);
+    if ((vc = db->vcache) == NULL || size > vc->maxsize / VCACHE_MAXENT) {
+        tndb_unlock(db);
+        return;
+    }
+
+    if (*(pp = vcache_slot(vc, hv, key, klen)) != NULL) { /* put by another
+                                                             thread */
+        tndb_unlock(db);
+        return;
+    }
+
+    while (vc->size + size > vc->maxsize)
+        vcache_evict(vc);
+
+    ent = n_malloc(size);
+    ent->hnext = NULL;
+    ent->hv = hv;
+    ent->klen = klen;
+    ent->vlen = vlen;
+    memcpy(ent->data, key, klen);
+    memcpy(ent->data + klen, val, vlen);
+
+    pp = vcache_slot(vc, hv, key, klen); /* eviction may change the chain */
+    *pp = ent;
+    lru_push(vc, ent);
+    vc->size += size;
+
+    tndb_unlock(db);
+}
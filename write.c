@@ -22,7 +22,8 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
-
+#include <errno.h>
+#include <zlib.h>
 
 #include <trurl/nmalloc.h>
 #include <trurl/narray.h>
@@ -71,6 +72,14 @@ struct tndb *tndb_creat(const char *name, int comprlevel, unsigned flags)
     unlink(path); /* unlink just after create, it's temporary file */
 
     type = tndb_detect_stream_type(name);
+
+    /* blocks are compressed by tndb itself */
+    if ((flags & TNDB_BLOCKZ) && type != TN_STREAM_STDIO) {
+        close(fd);
+        errno = EINVAL;
+        return NULL;
+    }
+
     if (type == TN_STREAM_GZIO || type ==  TN_STREAM_ZSTDIO || type == TN_STREAM_GZIO_NG) {
         if (comprlevel >= 0 && comprlevel < 10)
             snprintf(mode, sizeof(mode), "wb%d", comprlevel);
@@ -83,7 +92,11 @@ struct tndb *tndb_creat(const char *name, int comprlevel, unsigned flags)
     db->rtflags |= TNDB_R_MODE_W;
     db->st = st;
     db->path = n_strdupl(name, strlen(name));
-    if (db->hdr.flags & TNDB_SIGN_DIGEST)
+    db->comprlevel = comprlevel;
+
+    /* compressed blocks are digested instead of TNDB_BLOCKZ data */
+    if ((db->hdr.flags & TNDB_SIGN_ANY) &&
+        (db->hdr.xflags & TNDB_BLOCKZ) == 0)
         n_stream_set_write_hook(st, st_write_hook_write, &db->hdr.sign);
 
     return db;
@@ -91,9 +104,10 @@ struct tndb *tndb_creat(const char *name, int comprlevel, unsigned flags)
 
 static inline int put_key(struct tndb *db, const char *key, unsigned int aklen)
 {
-    uint32_t               hv, hv_i;
+    struct tndb_khash      kh;
+    uint32_t               hv_i;
     tn_array               *ht;
-    struct tndb_hent       *he;
+    struct tndb_whent      *he;
     uint8_t                klen;
 
     n_assert(db->rtflags & TNDB_R_MODE_W);
@@ -103,22 +117,43 @@ static inline int put_key(struct tndb *db, const char *key, unsigned int aklen)
     klen = aklen;
 
     if ((db->hdr.flags & TNDB_NOHASH) == 0) {
-        hv = tndb_hash(key, klen);
-        hv_i = hv & 0xff;
+        tndb_key_hash(&db->hdr, key, klen, &kh);
+        hv_i = kh.hb & (TNDB_HTSIZE - 1); /* laid out in tndbw_close() */
         ht = db->htt[hv_i];
 
         if (ht == NULL) {
-            ht = n_array_new(128, tndb_hent_free, (tn_fn_cmp)tndb_hent_cmp_store);
+            ht = n_array_new(128, tndb_whent_free, (tn_fn_cmp)tndb_whent_cmp_store);
             db->htt[hv_i] = ht;
         }
 
-        he = tndb_hent_new(db, hv, db->offs.current);
+        he = tndb_whent_new(db, kh.hv, db->offs.current);
+        he->hb = kh.hb;
+        he->hv2 = kh.hv2;
+        if (db->hdr.xflags & TNDB_FPRINT)
+            he->fp = TNDB_KH_FP(&kh, klen);
+
+        /* TNDB_MPHF tells apart keys of colliding hashes by them */
+        if (db->hdr.xflags & (TNDB_KEYIDX | TNDB_MPHF)) {
+            he->key = db->na->na_malloc(db->na, klen + 1);
+            memcpy(he->key, key, klen);
+            he->klen = klen;
+        }
+
         if (hv_i == 50)
             DBGF("addh[%d][%d] %s %u %u\n", hv_i, n_array_size(ht),
                  key, he->val, he->offs);
         n_array_push(ht, he);
     }
 
+    if (db->hdr.xflags & TNDB_ORDIDX) {
+        if (db->hdr.nrec == db->ordsize) {
+            db->ordsize = db->ordsize ? db->ordsize * 2 : 1024;
+            db->ordoffs = n_realloc(db->ordoffs,
+                                    db->ordsize * sizeof(*db->ordoffs));
+        }
+        db->ordoffs[db->hdr.nrec] = db->offs.current;
+    }
+
     n_assert(sizeof(klen) == 1);
     db->offs.current += sizeof(klen) + klen;
 
@@ -151,101 +186,637 @@ int tndb_put(struct tndb *db, const char *key, unsigned int aklen,
 }
 
 
-static uint32_t htt_store_size(struct tndb *db)
+/* all hash entries in one array */
+static struct tndb_whent **whents_collect(struct tndb *db, uint32_t *n)
+{
+    struct tndb_whent **ents;
+    uint32_t i, total = 0;
+
+    for (i=0; i < TNDB_HTSIZE; i++)
+        if (db->htt[i])
+            total += n_array_size(db->htt[i]);
+
+    ents = n_malloc((total + 1) * sizeof(*ents));
+    *n = 0;
+    for (i=0; i < TNDB_HTSIZE; i++) {
+        tn_array *ht = db->htt[i];
+
+        for (int j = 0; ht && j < n_array_size(ht); j++)
+            ents[(*n)++] = n_array_nth(ht, j);
+    }
+
+    n_assert(*n == total);
+    return ents;
+}
+
+/* TNDB_MPHF */
+#define MPH_LAMBDA    5         /* average number of keys in bucket */
+#define MPH_MAXSEEDS  64
+#define MPH_MAXD0     256       /* max d0 of displacement */
+
+static int whent_cmp_key(const void *a, const void *b)
+{
+    const struct tndb_whent *h1 = *(const struct tndb_whent **)a;
+    const struct tndb_whent *h2 = *(const struct tndb_whent **)b;
+
+    if (h1->val != h2->val)
+        return h1->val < h2->val ? -1 : 1;
+
+    if (h1->hv2 != h2->hv2)
+        return h1->hv2 < h2->hv2 ? -1 : 1;
+
+    return h1->offs < h2->offs ? -1 : (h1->offs > h2->offs);
+}
+
+/* tries to place all n keys using seed, fills db->mphdisp and db->mphents */
+static int mph_try(struct tndb *db, struct tndb_whent **ents, uint32_t n,
+                   uint32_t seed)
+{
+    uint32_t nb = db->hdr.mph_nbuckets, maxsize = 0, freeslot = 0;
+    uint32_t *h1, *h2, *bkt, *bstart, *bkeys, *border, *nsize, *taken;
+    uint32_t i, j, k, dmax;
+    int      rc = 0;
+
+    /* displacement is d0 * n + d1 */
+    if (UINT32_MAX / n < MPH_MAXD0)
+        dmax = (UINT32_MAX / n) * n;
+    else
+        dmax = MPH_MAXD0 * n;
+
+    h1 = n_malloc(n * sizeof(*h1));
+    h2 = n_malloc(n * sizeof(*h2));
+    bkt = n_malloc(n * sizeof(*bkt));
+    bkeys = n_malloc(n * sizeof(*bkeys));
+    bstart = n_calloc(nb + 1, sizeof(*bstart));
+    border = n_malloc(nb * sizeof(*border));
+    taken = n_calloc(n / 32 + 1, sizeof(*taken));
+
+    for (i=0; i < n; i++) {
+        uint32_t h[3];
+
+        tndb_mph_hash(ents[i]->val, ents[i]->hv2, seed, h);
+        bkt[i] = h[0] % nb;
+        h1[i] = h[1];
+        h2[i] = h[2];
+        bstart[bkt[i] + 1]++;
+    }
+
+    /* keys grouped by bucket, bucket b has bkeys[bstart[b]..bstart[b + 1]) */
+    for (i=0; i < nb; i++) {
+        uint32_t size = bstart[i + 1];
+
+        if (size > maxsize)
+            maxsize = size;
+        bstart[i + 1] += bstart[i];
+    }
+
+    for (i=0; i < n; i++) {
+        bkeys[bstart[bkt[i]]++] = i;
+    }
+
+    for (i=nb; i > 0; i--)      /* restore starts shifted by the loop above */
+        bstart[i] = bstart[i - 1];
+    bstart[0] = 0;
+
+    /* the biggest buckets go first, while the table is empty */
+    nsize = n_calloc(maxsize + 2, sizeof(*nsize));
+    for (i=0; i < nb; i++)
+        nsize[maxsize - (bstart[i + 1] - bstart[i]) + 1]++;
+
+    for (i=0; i <= maxsize; i++)
+        nsize[i + 1] += nsize[i];
+
+    for (i=0; i < nb; i++)
+        border[nsize[maxsize - (bstart[i + 1] - bstart[i])]++] = i;
+    free(nsize);
+
+    for (k=0; k < nb; k++) {
+        uint32_t b = border[k], size = bstart[b + 1] - bstart[b];
+        uint32_t *keys = &bkeys[bstart[b]], d;
+
+        if (size == 0)
+            break;
+
+        if (size == 1) {        /* any free slot fits */
+            uint32_t h[3];
+
+            while (taken[freeslot / 32] & (1U << (freeslot % 32)))
+                freeslot++;
+
+            h[1] = h1[keys[0]];
+            d = (freeslot + n - (h[1] % n)) % n;
+            db->mphdisp[b] = d;
+            taken[freeslot / 32] |= 1U << (freeslot % 32);
+            db->mphents[freeslot] = ents[keys[0]];
+            continue;
+        }
+
+        for (d = 0; d < dmax; d++) {
+            for (j=0; j < size; j++) {
+                uint32_t h[3], slot;
+
+                h[1] = h1[keys[j]];
+                h[2] = h2[keys[j]];
+                slot = tndb_mph_slot(h, d, n);
+
+                if (taken[slot / 32] & (1U << (slot % 32)))
+                    break;
+
+                taken[slot / 32] |= 1U << (slot % 32);
+                db->mphents[slot] = ents[keys[j]];
+            }
+
+            if (j == size)
+                break;
+
+            while (j-- > 0) {   /* rollback */
+                uint32_t h[3], slot;
+
+                h[1] = h1[keys[j]];
+                h[2] = h2[keys[j]];
+                slot = tndb_mph_slot(h, d, n);
+                taken[slot / 32] &= ~(1U << (slot % 32));
+            }
+        }
+
+        if (d == dmax) {
+            DBGF("seed %u: bucket %u of %u keys not placed\n", seed, b, size);
+            goto l_end;
+        }
+
+        db->mphdisp[b] = d;
+    }
+
+    rc = 1;
+
+ l_end:
+    free(h1);
+    free(h2);
+    free(bkt);
+    free(bkeys);
+    free(bstart);
+    free(border);
+    free(taken);
+    return rc;
+}
+
+/* returns 0 if keys could not be placed, TNDB_MPHF is dropped on hash
+   collision of distinct keys */
+static int mph_build(struct tndb *db)
+{
+    struct tndb_whent **ents;
+    uint32_t i, n = 0, total = 0, seed;
+
+    ents = whents_collect(db, &total);
+
+    /* the last of duplicated keys wins; distinct keys of the same hashes
+       would share a slot, hash table is built instead then */
+    qsort(ents, total, sizeof(*ents), whent_cmp_key);
+    n = 0;
+    for (i=0; i < total; i++) {
+        struct tndb_whent *prev = n > 0 ? ents[n - 1] : NULL;
+
+        if (prev == NULL || prev->val != ents[i]->val ||
+            prev->hv2 != ents[i]->hv2) {
+            ents[n++] = ents[i];
+
+        } else if (tndb_key_cmp(prev->key, prev->klen,
+                                ents[i]->key, ents[i]->klen) == 0) {
+            ents[n - 1] = ents[i];
+
+        } else {
+            DBGF("hash collision, falling back to hash table\n");
+            db->hdr.xflags &= ~TNDB_MPHF;
+            free(ents);
+            return 1;
+        }
+    }
+
+    db->hdr.mph_nkeys = n;
+    db->hdr.mph_nbuckets = (n + MPH_LAMBDA - 1) / MPH_LAMBDA;
+    db->mphdisp = n_calloc(db->hdr.mph_nbuckets + 1, sizeof(*db->mphdisp));
+    db->mphents = n_calloc(n + 1, sizeof(*db->mphents));
+
+    for (seed = 0; n > 0 && seed < MPH_MAXSEEDS; seed++) {
+        if (mph_try(db, ents, n, seed))
+            break;
+    }
+
+    free(ents);
+    db->hdr.mph_seed = seed;
+    DBGF("%u keys, %u buckets, seed %u\n", n, db->hdr.mph_nbuckets, seed);
+
+    return n == 0 || seed < MPH_MAXSEEDS;
+}
+
+/* number of buckets scaled to nrec (TNDB_HTSCALE), power of two */
+static uint32_t htt_scaled_size(uint32_t nrec)
+{
+    uint32_t size = TNDB_HTSIZE;
+
+    while (size < TNDB_HTSIZE_MAX && size * TNDB_HTLOAD < nrec)
+        size <<= 1;
+
+    return size;
+}
+
+static int whent_cmp_bucket(const void *a, const void *b)
 {
-    uint32_t size;
-    int i;
+    const struct tndb_whent *h1 = *(const struct tndb_whent **)a;
+    const struct tndb_whent *h2 = *(const struct tndb_whent **)b;
 
+    if (h1->hb != h2->hb)
+        return h1->hb < h2->hb ? -1 : 1;
+
+    return tndb_whent_cmp_store(h1, (struct tndb_whent *)h2);
+}
+
+/* lays entries out in buckets, sorted by bucket, val and offs */
+static void htt_build(struct tndb *db)
+{
+    uint32_t i, mask = db->hdr.htsize - 1;
+
+    db->wents = whents_collect(db, &db->nwents);
+
+    for (i=0; i < db->nwents; i++)
+        db->wents[i]->hb &= mask; /* bucket selector -> bucket */
+
+    qsort(db->wents, db->nwents, sizeof(*db->wents), whent_cmp_bucket);
+}
+
+/* end of bucket i which entries start at wents[j] */
+static inline uint32_t htt_bucket_end(struct tndb *db, uint32_t i, uint32_t j)
+{
+    while (j < db->nwents && db->wents[j]->hb == i)
+        j++;
+
+    return j;
+}
+
+static uint32_t htt_store_size(struct tndb *db)
+{
     if (db->hdr.flags & TNDB_NOHASH)
         return 0;
 
-    size = TNDB_HTBYTESIZE;
+    if (db->hdr.xflags & TNDB_MPHF) {
+        uint32_t esize = sizeof(uint32_t); /* offs */
 
-    for (i=0; i < TNDB_HTSIZE; i++) {
-        tn_array *hash0 = db->htt[i];
+        if (db->hdr.xflags & TNDB_FPRINT)
+            esize += sizeof(uint32_t);
 
-        if (hash0 == NULL || n_array_size(hash0) == 0)
-            size += sizeof(uint32_t); /* 0 */
+        return db->hdr.mph_nbuckets * sizeof(uint32_t) +
+            db->hdr.mph_nkeys * esize;
+    }
 
-        else {
-            size += sizeof(uint32_t); /* table size */
-            /* val + offs */
-            size += n_array_size(hash0) * (2 * sizeof(uint32_t));
+    /* offsets table, then every bucket as [size][val, offs[, fp]]... */
+    return TNDB_HTBYTESIZE(&db->hdr) + db->hdr.htsize * sizeof(uint32_t) +
+        db->nwents * TNDB_HENT_STORE_SIZE(&db->hdr);
+}
+
+
+/* TNDB_BLOOM filter, stored after hash table */
+static uint32_t bloom_store_size(struct tndb *db)
+{
+    if ((db->hdr.xflags & TNDB_BLOOM) == 0)
+        return 0;
+
+    return db->hdr.bloom_nblocks * TNDB_BLOOM_BLKSIZE;
+}
+
+static void bloom_build(struct tndb *db)
+{
+    uint64_t nblocks;
+    int      i;
+
+    nblocks = ((uint64_t)db->hdr.nrec * TNDB_BLOOM_BITS +
+               TNDB_BLOOM_BLKSIZE * 8 - 1) / (TNDB_BLOOM_BLKSIZE * 8);
+
+    if (nblocks == 0)
+        nblocks = 1;
+    else if (nblocks > TNDB_BLOOM_NBLOCKS_MAX)
+        nblocks = TNDB_BLOOM_NBLOCKS_MAX;
+
+    db->hdr.bloom_nblocks = nblocks;
+    db->bloombuf = n_calloc(nblocks, TNDB_BLOOM_BLKSIZE);
+
+    for (i=0; i < TNDB_HTSIZE; i++) {
+        tn_array *ht = db->htt[i];
+
+        for (int j = 0; ht && j < n_array_size(ht); j++) {
+            struct tndb_whent *he = n_array_nth(ht, j);
+            tndb_bloom_add(db->bloombuf, nblocks, he->val, he->hv2);
         }
     }
+}
 
-    return size;
+static int bloom_write(struct tndb *db, int digest)
+{
+    uint32_t size = bloom_store_size(db);
+
+    if (digest) {
+        tndb_sign_update(&db->hdr.sign, db->bloombuf, size);
+        return 1;
+    }
+
+    return n_stream_write(db->st, db->bloombuf, size) == (int)size;
 }
 
+/* TNDB_KEYIDX: keys in byte order, the last of duplicates goes last */
+static int whent_cmp_kidx(const void *a, const void *b)
+{
+    const struct tndb_whent *h1 = *(const struct tndb_whent **)a;
+    const struct tndb_whent *h2 = *(const struct tndb_whent **)b;
+    int cmp;
+
+    if ((cmp = tndb_key_cmp(h1->key, h1->klen, h2->key, h2->klen)) != 0)
+        return cmp;
+
+    return h1->offs < h2->offs ? -1 : (h1->offs > h2->offs ? 1 : 0);
+}
+
+/* sorted index of distinct keys, duplicates are indexed by the last one */
+static void kidx_build(struct tndb *db)
+{
+    struct tndb_whent **ents;
+    uint32_t i, n, nkeys = 0;
+
+    ents = whents_collect(db, &n);
+    qsort(ents, n, sizeof(*ents), whent_cmp_kidx);
+
+    for (i=0; i < n; i++) {
+        if (i + 1 < n && tndb_key_cmp(ents[i]->key, ents[i]->klen,
+                                      ents[i + 1]->key, ents[i + 1]->klen) == 0)
+            continue;
+
+        ents[nkeys++] = ents[i];
+    }
+
+    db->kidxents = ents;
+    db->hdr.kidx_nkeys = nkeys;
+}
+
+static uint32_t kidx_store_size(struct tndb *db)
+{
+    if ((db->hdr.xflags & TNDB_KEYIDX) == 0)
+        return 0;
+
+    return db->hdr.kidx_nkeys * sizeof(uint32_t);
+}
+
+static int kidx_write(struct tndb *db, uint32_t data_offs, int digest)
+{
+    uint32_t i;
+
+    for (i=0; i < db->hdr.kidx_nkeys; i++) {
+        uint32_t offs = db->kidxents[i]->offs + data_offs;
+
+        if (digest)
+            tndb_sign_update_int32(&db->hdr.sign, offs);
+
+        else if (!n_stream_write_uint32(db->st, offs))
+            return 0;
+    }
+
+    return 1;
+}
+
+static uint32_t ordidx_store_size(struct tndb *db)
+{
+    if ((db->hdr.xflags & TNDB_ORDIDX) == 0)
+        return 0;
+
+    return db->hdr.nrec * sizeof(uint32_t);
+}
+
+static int ordidx_write(struct tndb *db, uint32_t data_offs, int digest)
+{
+    uint32_t i;
+
+    for (i=0; i < db->hdr.nrec; i++) {
+        uint32_t offs = db->ordoffs[i] + data_offs;
+
+        if (digest)
+            tndb_sign_update_int32(&db->hdr.sign, offs);
+
+        else if (!n_stream_write_uint32(db->st, offs))
+            return 0;
+    }
+
+    return 1;
+}
+
+/* TNDB_BLOCKZ block offsets table, stored just before the data */
+static uint32_t blkz_store_size(struct tndb *db)
+{
+    if ((db->hdr.xflags & TNDB_BLOCKZ) == 0)
+        return 0;
+
+    return (db->hdr.nblocks + 1) * sizeof(uint32_t);
+}
+
+/* TNDB_SIGN_MERKLE table, digests of data chunks made while data was
+   being written */
+static void mrkl_build(struct tndb *db)
+{
+    struct tndb_sign *sign = &db->hdr.sign;
+    uint32_t size = db->hdr.mrkl_nchunks * TNDB_SIGN_TREE_MDSIZE;
+
+    tndb_sign_region(sign);     /* the last data chunk */
+    n_assert(sign->nchunks == db->hdr.mrkl_nchunks);
+
+    db->mrkl = n_malloc(size ? size : 1);
+    memcpy(db->mrkl, sign->chunks, size);
+}
+
+static uint32_t mrkl_store_size(struct tndb *db)
+{
+    if ((db->hdr.xflags & TNDB_SIGN_MERKLE) == 0)
+        return 0;
+
+    return db->hdr.mrkl_nchunks * TNDB_SIGN_TREE_MDSIZE;
+}
+
+static int mrkl_write(struct tndb *db, int digest)
+{
+    uint32_t size = mrkl_store_size(db);
+
+    if (digest) {
+        tndb_sign_update(&db->hdr.sign, db->mrkl, size);
+        return 1;
+    }
+
+    return n_stream_write(db->st, db->mrkl, size) == (int)size;
+}
+
+/* sections stored after hash table: TNDB_BLOOM filter, TNDB_KEYIDX and
+   TNDB_ORDIDX indexes, TNDB_SIGN_MERKLE table and TNDB_BLOCKZ block offsets
+   table */
+static uint32_t tail_store_size(struct tndb *db)
+{
+    return bloom_store_size(db) + kidx_store_size(db) +
+        ordidx_store_size(db) + mrkl_store_size(db) + blkz_store_size(db);
+}
+
+static int mph_write(struct tndb *db, uint32_t data_offs)
+{
+    uint32_t i;
+
+    for (i=0; i < db->hdr.mph_nbuckets; i++) {
+        if (!n_stream_write_uint32(db->st, db->mphdisp[i]))
+            return 0;
+    }
+
+    for (i=0; i < db->hdr.mph_nkeys; i++) {
+        struct tndb_whent *he = db->mphents[i];
+
+        if (!n_stream_write_uint32(db->st, he->offs + data_offs))
+            return 0;
+
+        if ((db->hdr.xflags & TNDB_FPRINT) &&
+            !n_stream_write_uint32(db->st, he->fp))
+            return 0;
+    }
+
+    return 1;
+}
 
 static int htt_write(struct tndb *db)
 {
-    unsigned int i;
-    uint32_t data_offs, htt_size, ht_offs;
+    uint32_t i, j, data_offs, htt_size, ht_offs;
 
     n_assert((db->hdr.flags & TNDB_NOHASH) == 0);
 
     htt_size = htt_store_size(db);
-    data_offs = tndb_hdr_store_sizeof(&db->hdr) + htt_size;
+    data_offs = tndb_hdr_store_sizeof(&db->hdr) + htt_size +
+        tail_store_size(db);
 
-    ht_offs = tndb_hdr_store_sizeof(&db->hdr) + TNDB_HTBYTESIZE;
+    if (db->hdr.xflags & TNDB_MPHF)
+        return mph_write(db, data_offs);
+
+    ht_offs = tndb_hdr_store_sizeof(&db->hdr) + TNDB_HTBYTESIZE(&db->hdr);
     //printf("data_offset %x\n", data_offs);
     DBGF("start at %ld, data_offs %d, ht_offs %d\n",
          n_stream_tell(db->st), data_offs, ht_offs);
 
-    for (i=0; i < TNDB_HTSIZE; i++) {
-        tn_array *ht = db->htt[i];
+    for (i=0, j=0; i < db->hdr.htsize; i++) {
+        uint32_t end = htt_bucket_end(db, i, j);
 
-        if (ht == NULL) {
+        if (end == j) {
             if (!n_stream_write_uint32(db->st, 0))
                 return 0;
 
             ht_offs += sizeof(uint32_t);
 
         } else {
-            n_assert(n_array_size(ht) > 0);
             if (!n_stream_write_uint32(db->st, ht_offs))
                 return 0;
 
             DBGF("w[%d] %d\n", i, ht_offs);
             ht_offs += sizeof(uint32_t); /* table size */
-            ht_offs += n_array_size(ht) * (2 * sizeof(uint32_t));
+            ht_offs += (end - j) * TNDB_HENT_STORE_SIZE(&db->hdr);
         }
+        j = end;
     }
 
-    n_assert(ht_offs == data_offs);
+    n_assert(ht_offs + tail_store_size(db) == data_offs);
     //DBGF("data_offset = %u\n", data_offs);
 
+    for (i=0, j=0; i < db->hdr.htsize; i++) {
+        uint32_t end = htt_bucket_end(db, i, j);
 
-    for (i=0; i < TNDB_HTSIZE; i++) {
-        tn_array *ht = db->htt[i];
+        if (!n_stream_write_uint32(db->st, end - j))
+            return 0;
 
-        if (ht == NULL || n_array_size(ht) == 0) {
-            if (!n_stream_write_uint32(db->st, 0))
+        for (; j < end; j++) {
+            struct tndb_whent *he = db->wents[j];
+
+            DBGF("at %ld h0[%d](%u) (%d+) %d\n", n_stream_tell(db->st),
+                 i, he->val, data_offs, he->offs);
+
+            if (!n_stream_write_uint32(db->st, he->val))
                 return 0;
 
-        } else {
-            n_array_sort(ht);
-            if (!n_stream_write_uint32(db->st, n_array_size(ht)))
+            if (!n_stream_write_uint32(db->st, he->offs + data_offs))
                 return 0;
 
-            for (int j = 0; j < n_array_size(ht); j++) {
-                struct tndb_hent *he = n_array_nth(ht, j);
+            if ((db->hdr.xflags & TNDB_FPRINT) &&
+                !n_stream_write_uint32(db->st, he->fp))
+                return 0;
+        }
+    }
+
+    return 1;
+}
+
+/*
+  Compresses data of fdin into blocks written at doffs of fdout, the
+  compressed data is digested as it is what lands in the file.
+*/
+static int blkz_write(struct tndb *db, int fdin, int fdout)
+{
+    unsigned char *buf, *zbuf;
+    uLongf        zbound;
+    uint32_t      i, offs;
+    int           level, rc = 0;
 
+    level = db->comprlevel;
+    if (level < 0 || level > 9)
+        level = Z_DEFAULT_COMPRESSION;
 
-                //if (i == 50)
-                DBGF("at %ld h0[%d].h1[%d](%u) (%d+) %d\n",
-                     n_stream_tell(db->st),
-                     i, j,
-                     he->val, data_offs, he->offs);
+    zbound = compressBound(db->hdr.blksize);
+    buf = n_malloc(db->hdr.blksize);
+    zbuf = n_malloc(zbound);
 
-                if (!n_stream_write_uint32(db->st, he->val))
-                    return 0;
+    db->blkoffs = n_malloc((db->hdr.nblocks + 1) * sizeof(*db->blkoffs));
+    offs = db->hdr.doffs;
 
-                if (!n_stream_write_uint32(db->st, he->offs + data_offs))
-                    return 0;
-            }
-        }
+    if (lseek(fdin, 0, SEEK_SET) == -1 || lseek(fdout, offs, SEEK_SET) == -1)
+        goto l_end;
+
+    for (i=0; i < db->hdr.nblocks; i++) {
+        ssize_t nread, n = 0;
+        uLongf  zlen = zbound;
+
+        while (n < (ssize_t)db->hdr.blksize &&
+               (nread = read(fdin, buf + n, db->hdr.blksize - n)) > 0)
+            n += nread;
+
+        if (n == 0)
+            goto l_end;
+
+        if (compress2(zbuf, &zlen, buf, n, level) != Z_OK)
+            goto l_end;
+
+        if (write(fdout, zbuf, zlen) != (ssize_t)zlen)
+            goto l_end;
+
+        if (db->hdr.flags & TNDB_SIGN_ANY)
+            tndb_sign_update(&db->hdr.sign, zbuf, zlen);
+
+        DBGF("block %u: %zd -> %lu at %u\n", i, n, zlen, offs);
+        db->blkoffs[i] = offs;
+        offs += zlen;
+    }
+
+    db->blkoffs[db->hdr.nblocks] = offs;
+    rc = 1;
+
+ l_end:
+    free(buf);
+    free(zbuf);
+    return rc;
+}
+
+static int blkz_table_write(struct tndb *db, int digest)
+{
+    uint32_t i;
+
+    for (i=0; i <= db->hdr.nblocks; i++) {
+        if (digest)
+            tndb_sign_update_int32(&db->hdr.sign, db->blkoffs[i]);
+
+        else if (!n_stream_write_uint32(db->st, db->blkoffs[i]))
+            return 0;
     }
 
     return 1;
@@ -256,7 +827,7 @@ static int htt_compute_digest(struct tndb *db)
 {
     int rc;
 
-    n_assert(db->hdr.flags & TNDB_SIGN_DIGEST);
+    n_assert(db->hdr.flags & TNDB_SIGN_ANY);
     n_stream_set_write_hook(db->st, st_write_hook_nowrite, &db->hdr.sign);
     rc = htt_write(db);
     n_stream_set_write_hook(db->st, st_write_hook_write, &db->hdr.sign);
@@ -284,19 +855,70 @@ static int tndbw_close(struct tndb *db)
     if ((fdout = open(db->path, O_RDWR | O_CREAT | O_TRUNC, 0666)) == -1)
         goto l_end;
 
+    if ((db->hdr.flags & TNDB_NOHASH) == 0) {
+        if ((db->hdr.xflags & TNDB_MPHF) && !mph_build(db))
+            goto l_end;
+
+        /* not TNDB_MPHF or mph_build() dropped it */
+        if ((db->hdr.xflags & TNDB_MPHF) == 0) {
+            if (db->hdr.xflags & TNDB_HTSCALE)
+                db->hdr.htsize = htt_scaled_size(db->hdr.nrec);
+            htt_build(db);
+        }
+
+        if (db->hdr.xflags & TNDB_BLOOM)
+            bloom_build(db);
+
+        if (db->hdr.xflags & TNDB_KEYIDX)
+            kidx_build(db);
+    }
+
+    if (db->hdr.xflags & TNDB_BLOCKZ) {
+        db->hdr.blksize = TNDB_BLKZ_SIZE;
+        db->hdr.nblocks = (db->offs.current + TNDB_BLKZ_SIZE - 1) / TNDB_BLKZ_SIZE;
+    }
+
+    if (db->hdr.xflags & TNDB_SIGN_MERKLE)
+        db->hdr.mrkl_nchunks = ((uint64_t)db->offs.current +
+                                TNDB_SIGN_CHUNK - 1) / TNDB_SIGN_CHUNK;
+
+    db->hdr.doffs = tndb_hdr_store_sizeof(&db->hdr) + htt_store_size(db) +
+        tail_store_size(db);
+    //printf("headers = %d\n", db->hdr.doffs);
+
+    /* data goes first, it's digested first */
+    if (db->hdr.xflags & TNDB_BLOCKZ) {
+        if (!blkz_write(db, fdin, fdout))
+            goto l_end;
+    }
+
     if ((db->st = n_stream_dopen(fdout, "wb", type)) == NULL)
         goto l_end;
 
-    db->hdr.doffs = tndb_hdr_store_sizeof(&db->hdr) + htt_store_size(db);
-    //printf("headers = %d\n", db->hdr.doffs);
+    if (db->hdr.flags & TNDB_SIGN_ANY) {
+        if (db->hdr.xflags & TNDB_SIGN_MERKLE)
+            mrkl_build(db);
 
-    if (db->hdr.flags & TNDB_SIGN_DIGEST) {
         tndb_hdr_compute_digest(&db->hdr);
 
         if ((db->hdr.flags & TNDB_NOHASH) == 0)
             if (!htt_compute_digest(db))
                 goto l_end;
 
+        if (db->hdr.xflags & TNDB_BLOOM)
+            bloom_write(db, 1);
+
+        if (db->hdr.xflags & TNDB_KEYIDX)
+            kidx_write(db, db->hdr.doffs, 1);
+
+        if (db->hdr.xflags & TNDB_ORDIDX)
+            ordidx_write(db, db->hdr.doffs, 1);
+
+        if (db->hdr.xflags & TNDB_SIGN_MERKLE)
+            mrkl_write(db, 1);
+
+        if (db->hdr.xflags & TNDB_BLOCKZ)
+            blkz_table_write(db, 1);
 
         n_stream_set_write_hook(db->st, NULL, NULL);
         tndb_sign_final(&db->hdr.sign);
@@ -310,6 +932,30 @@ static int tndbw_close(struct tndb *db)
             goto l_end;
     }
 
+    if ((db->hdr.xflags & TNDB_BLOOM) && !bloom_write(db, 0))
+        goto l_end;
+
+    if ((db->hdr.xflags & TNDB_KEYIDX) && !kidx_write(db, db->hdr.doffs, 0))
+        goto l_end;
+
+    if ((db->hdr.xflags & TNDB_ORDIDX) && !ordidx_write(db, db->hdr.doffs, 0))
+        goto l_end;
+
+    if ((db->hdr.xflags & TNDB_SIGN_MERKLE) && !mrkl_write(db, 0))
+        goto l_end;
+
+    if (db->hdr.xflags & TNDB_BLOCKZ) {
+        if (!blkz_table_write(db, 0))
+            goto l_end;
+
+        n_stream_close(db->st);   /* closes fdout too */
+        db->st = NULL;
+        fdout = -1;
+
+        rc = 1;                 /* data is already there */
+        goto l_end;
+    }
+
     n_stream_flush(db->st);
     if ((fdout = dup(db->st->fd)) == -1)
         goto l_end;
@@ -358,7 +1004,7 @@ int tndb_close(struct tndb *db)
         if ((db->rtflags & TNDB_R_UNLINKED) == 0)
             return tndbw_close(db);
 
-        else if (db->hdr.flags & TNDB_SIGN_DIGEST)
+        else if (db->hdr.flags & TNDB_SIGN_ANY)
             tndb_sign_final(&db->hdr.sign);
     }
 